@@ -38,6 +38,7 @@
 #endif
 
 #include "hid-gcommon.h"
+#include "hid-ginput-trace.h"
 
 #ifdef __GNUC__
 #define __UNUSED __attribute__ ((unused))
@@ -48,8 +49,7 @@
 #define G110_NAME "Logitech G110"
 
 /* Key defines */
-#define G110_KEYS 17
-#define G110_KEYMAP_SIZE (G110_KEYS*3)
+#define G110_KEYS 32
 
 /* Backlight defaults */
 #define G110_DEFAULT_RED (0)
@@ -124,7 +124,8 @@ struct g110_data {
  * M2         13
  * M3         14
  * MR         15
- * LIGHT      19
+ * LIGHT      16
+ * ep1 keys   24-31  (unmapped)
  */
 static const unsigned int g110_default_key_map[G110_KEYS] = {
 	KEY_F1, KEY_F2, KEY_F3, KEY_F4,
@@ -375,13 +376,18 @@ static DEVICE_ATTR(keymap_switching, 0644,
                    ginput_keymap_switching_show,
                    ginput_keymap_switching_store);
 
+static BIN_ATTR(keymap_bin, 0644,
+                ginput_keymap_bin_read,
+                ginput_keymap_bin_write, 0);
+
 /* change leds when the keymap was changed */
 static void g110_notify_keymap_switched(struct gcommon_data * gdata,
                                         unsigned int index)
 {
 	struct g110_data * g110data = gdata->data;
 
-	g110data->led = 1 << index;
+	/* Only M1 to M3 have a LED */
+	g110data->led = index < 3 ? 1 << index : 0;
 	g110_led_send(gdata->hdev);
 }
 
@@ -503,10 +509,27 @@ static struct attribute *g110_attrs[] = {
  * created for the attributes with the directory being the name of the
  * attribute group.
  */
+static struct bin_attribute *g110_bin_attrs[] = {
+	&bin_attr_keymap_bin,
+	NULL,
+};
+
 static struct attribute_group g110_attr_group = {
 	.attrs = g110_attrs,
+	.bin_attrs = g110_bin_attrs,
+};
+
+
+static const struct ginput_key_field g110_key_fields[] = {
+	{ 1, 0xff,  0 },        /* Keys G1 through G8 */
+	{ 2, 0xff,  8 },        /* Keys G9 through MR */
+	{ 3, 0x01, 16 },        /* Key Light Only */
 };
 
+/* The keys sent on the ep1 interrupt endpoint */
+static const struct ginput_key_field g110_ep1_key_fields[] = {
+	{ 0, 0xff, 24 },
+};
 
 static void g110_raw_event_process_input(struct hid_device *hdev,
         struct gcommon_data *gdata,
@@ -514,10 +537,6 @@ static void g110_raw_event_process_input(struct hid_device *hdev,
 {
 	struct input_dev *idev = gdata->input_dev;
 	struct ginput_data *input_data = &gdata->input_data;
-	int scancode;
-	int value;
-	int i;
-	int mask;
 
 	/*
 	 * We'll check for the M* keys being pressed before processing
@@ -533,28 +552,11 @@ static void g110_raw_event_process_input(struct hid_device *hdev,
 			ginput_set_keymap_index(gdata, 2);
 	}
 
-	raw_data[3] &= 0xBF; /* bit 6 is always on */
-
-	for (i = 0, mask = 0x01; i < 8; i++, mask <<= 1) {
-		/* Keys G1 through G8 */
-		scancode = i;
-		value = raw_data[1] & mask;
-		ginput_handle_key_event(gdata, scancode, value);
-
-		/* Keys G9 through MR */
-		scancode = i + 8;
-		value = raw_data[2] & mask;
-		ginput_handle_key_event(gdata, scancode, value);
-
-		/* Key Light Only */
-		if(i == 0) {
-			scancode = i + 16;
-			value = raw_data[3] & mask;
-			ginput_handle_key_event(gdata, scancode, value);
-		}
-
-	}
+	ginput_handle_key_report(gdata, GINPUT_REPORT_KEYS,
+	                         g110_key_fields, ARRAY_SIZE(g110_key_fields),
+	                         raw_data);
 
+	trace_ginput_sync(gdata);
 	input_sync(idev);
 }
 
@@ -569,6 +571,8 @@ static int g110_raw_event(struct hid_device *hdev,
 	struct gcommon_data *gdata = dev_get_gdata(&hdev->dev);
 	struct g110_data *g110data = gdata->data;
 
+	trace_ginput_raw_event(hdev, report->id, size);
+
 	spin_lock(&gdata->lock);
 
 	if (unlikely(g110data->need_reset)) {
@@ -619,18 +623,6 @@ static int g110_raw_event(struct hid_device *hdev,
 	return 0;
 }
 
-static void g110_initialize_keymap(struct gcommon_data *gdata)
-{
-	int i;
-
-	for (i = 0; i < G110_KEYS; i++) {
-		gdata->input_data.keycode[i] = g110_default_key_map[i];
-		__set_bit(gdata->input_data.keycode[i], gdata->input_dev->keybit);
-	}
-
-	__clear_bit(KEY_RESERVED, gdata->input_dev->keybit);
-}
-
 /* Unlock the urb so we can reuse it */
 static void g110_ep1_urb_completion(struct urb *urb)
 {
@@ -638,11 +630,12 @@ static void g110_ep1_urb_completion(struct urb *urb)
 	struct gcommon_data *gdata = hid_get_gdata(hdev);
 	struct g110_data *g110data = gdata->data;
 	struct input_dev *idev = gdata->input_dev;
-	int i;
 
-	for (i = 0; i < 8; i++)
-		ginput_handle_key_event(gdata, 24+i, g110data->ep1keys[0]&(1<<i));
+	ginput_handle_key_report(gdata, GINPUT_REPORT_EP1,
+	                         g110_ep1_key_fields, ARRAY_SIZE(g110_ep1_key_fields),
+	                         g110data->ep1keys);
 
+	trace_ginput_sync(gdata);
 	input_sync(idev);
 
 	usb_submit_urb(urb, GFP_ATOMIC);
@@ -777,8 +770,6 @@ static int g110_probe(struct hid_device *hdev,
 	gdata->input_dev->id.product = hdev->product;
 	gdata->input_dev->id.version = hdev->version;
 	gdata->input_dev->dev.parent = hdev->dev.parent;
-	gdata->input_dev->keycode = gdata->input_data.keycode;
-	gdata->input_dev->keycodemax = G110_KEYMAP_SIZE;
 	gdata->input_dev->keycodesize = sizeof(int);
 	gdata->input_dev->setkeycode = ginput_setkeycode;
 	gdata->input_dev->getkeycode = ginput_getkeycode;
@@ -794,7 +785,7 @@ static int g110_probe(struct hid_device *hdev,
 		goto err_cleanup_input_dev;
 	}
 
-	g110_initialize_keymap(gdata);
+	ginput_init_keymap(gdata, g110_default_key_map);
 
 	error = input_register_device(gdata->input_dev);
 	if (error) {
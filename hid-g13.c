@@ -38,6 +38,7 @@
 #endif
 
 #include "hid-gcommon.h"
+#include "hid-ginput-trace.h"
 
 #ifdef __GNUC__
 #define __UNUSED __attribute__ ((unused))
@@ -49,7 +50,6 @@
 
 /* Key defines */
 #define G13_KEYS 35
-#define G13_KEYMAP_SIZE (G13_KEYS*3)
 
 /* Framebuffer defines */
 #define G13FB_NAME "g13fb"
@@ -400,13 +400,18 @@ static DEVICE_ATTR(keymap_switching, 0644,
                    ginput_keymap_switching_show,
                    ginput_keymap_switching_store);
 
+static BIN_ATTR(keymap_bin, 0644,
+                ginput_keymap_bin_read,
+                ginput_keymap_bin_write, 0);
+
 /* change leds when the keymap was changed */
 static void g13_notify_keymap_switched(struct gcommon_data * gdata,
                                        unsigned int index)
 {
 	struct g13_data * g13data = hid_get_g13data(gdata->hdev);
 
-	g13data->led = 1 << index;
+	/* Only M1 to M3 have a LED */
+	g13data->led = index < 3 ? 1 << index : 0;
 	g13_led_send(gdata->hdev);
 }
 
@@ -532,21 +537,31 @@ static struct attribute *g13_attrs[] = {
  * created for the attributes with the directory being the name of the
  * attribute group.
  */
+static struct bin_attribute *g13_bin_attrs[] = {
+	&bin_attr_keymap_bin,
+	NULL,
+};
+
 static struct attribute_group g13_attr_group = {
 	.attrs = g13_attrs,
+	.bin_attrs = g13_bin_attrs,
 };
 
 
+static const struct ginput_key_field g13_key_fields[] = {
+	{ 3, 0xff,  0 },        /* Keys G1 through G8 */
+	{ 4, 0xff,  8 },        /* Keys G9 through G16 */
+	{ 5, 0x3f, 16 },        /* Keys G17 through G22 */
+	{ 6, 0xff, 22 },        /* Keys FUNC through M3 */
+	{ 7, 0x1f, 30 },        /* Keys MR through LIGHT */
+};
+
 static void g13_raw_event_process_input(struct hid_device *hdev,
                                         struct gcommon_data *gdata,
                                         u8 *raw_data)
 {
 	struct input_dev *idev = gdata->input_dev;
 	struct ginput_data *input_data = &gdata->input_data;
-	int scancode;
-	int value;
-	int i;
-	int mask;
 
 	/*
 	 * We'll check for the M* keys being pressed before processing
@@ -562,37 +577,13 @@ static void g13_raw_event_process_input(struct hid_device *hdev,
 			ginput_set_keymap_index(gdata, 2);
 	}
 
-	for (i = 0, mask = 0x01; i < 8; i++, mask <<= 1) {
-		/* Keys G1 through G8 */
-		scancode = i;
-		value = raw_data[3] & mask;
-		ginput_handle_key_event(gdata, scancode, value);
-
-		/* Keys G9 through G16 */
-		scancode = i + 8;
-		value = raw_data[4] & mask;
-		ginput_handle_key_event(gdata, scancode, value);
-
-		/* Keys G17 through G22 */
-		scancode = i + 16;
-		value = raw_data[5] & mask;
-		if (i <= 5)
-			ginput_handle_key_event(gdata, scancode, value);
-
-		/* Keys FUNC through M3 */
-		scancode = i + 22;
-		value = raw_data[6] & mask;
-		ginput_handle_key_event(gdata, scancode, value);
-
-		/* Keys MR through LIGHT */
-		scancode = i + 30;
-		value = raw_data[7] & mask;
-		if (i <= 4)
-			ginput_handle_key_event(gdata, scancode, value);
-	}
+	ginput_handle_key_report(gdata, GINPUT_REPORT_KEYS,
+	                         g13_key_fields, ARRAY_SIZE(g13_key_fields),
+	                         raw_data);
 
 	input_report_abs(idev, ABS_X, raw_data[1]);
 	input_report_abs(idev, ABS_Y, raw_data[2]);
+	trace_ginput_sync(gdata);
 	input_sync(idev);
 }
 
@@ -609,6 +600,8 @@ static int g13_raw_event(struct hid_device *hdev,
 	struct gcommon_data *gdata = dev_get_gdata(&hdev->dev);
 	struct g13_data *g13data = gdata->data;
 
+	trace_ginput_raw_event(hdev, report->id, size);
+
 	spin_lock_irqsave(&gdata->lock, irq_flags);
 
 	if (unlikely(g13data->ready_stages != G13_READY_STAGE_3)) {
@@ -651,18 +644,6 @@ static int g13_raw_event(struct hid_device *hdev,
 	return 0;
 }
 
-static void g13_initialize_keymap(struct gcommon_data *gdata)
-{
-	int i;
-
-	for (i = 0; i < G13_KEYS; i++) {
-		gdata->input_data.keycode[i] = g13_default_key_map[i];
-		__set_bit(gdata->input_data.keycode[i], gdata->input_dev->keybit);
-	}
-
-	__clear_bit(KEY_RESERVED, gdata->input_dev->keybit);
-}
-
 static int g13_probe(struct hid_device *hdev,
                      const struct hid_device_id *id)
 {
@@ -758,8 +739,6 @@ static int g13_probe(struct hid_device *hdev,
 	gdata->input_dev->id.product = hdev->product;
 	gdata->input_dev->id.version = hdev->version;
 	gdata->input_dev->dev.parent = hdev->dev.parent;
-	gdata->input_dev->keycode = gdata->input_data.keycode;
-	gdata->input_dev->keycodemax = G13_KEYMAP_SIZE;
 	gdata->input_dev->keycodesize = sizeof(int);
 	gdata->input_dev->setkeycode = ginput_setkeycode;
 	gdata->input_dev->getkeycode = ginput_getkeycode;
@@ -782,7 +761,7 @@ static int g13_probe(struct hid_device *hdev,
 		goto err_cleanup_input_dev;
 	}
 
-	g13_initialize_keymap(gdata);
+	ginput_init_keymap(gdata, g13_default_key_map);
 
 	error = input_register_device(gdata->input_dev);
 	if (error) {
@@ -39,6 +39,7 @@
 #endif
 
 #include "hid-gcommon.h"
+#include "hid-ginput-trace.h"
 
 #ifdef __GNUC__
 #define __UNUSED __attribute__ ((unused))
@@ -50,7 +51,6 @@
 
 /* Key defines */
 #define G15_KEYS 64
-#define G15_KEYMAP_SIZE (G15_KEYS*3)
 
 /* Backlight defaults */
 #define G15_DEFAULT_RED (0)
@@ -429,13 +429,18 @@ static DEVICE_ATTR(keymap_switching, 0644,
                    ginput_keymap_switching_show,
                    ginput_keymap_switching_store);
 
+static BIN_ATTR(keymap_bin, 0644,
+                ginput_keymap_bin_read,
+                ginput_keymap_bin_write, 0);
+
 /* change leds when the keymap was changed */
 static void g15_notify_keymap_switched(struct gcommon_data * gdata,
                                        unsigned int index)
 {
 	struct g15_data * g15data = gdata->data;
 
-	g15data->led = 1 << index;
+	/* Only M1 to M3 have a LED */
+	g15data->led = index < 3 ? 1 << index : 0;
 	g15_msg_send(gdata->hdev, 4, ~g15data->led, 0);
 }
 
@@ -560,21 +565,34 @@ static struct attribute *g15_attrs[] = {
  * created for the attributes with the directory being the name of the
  * attribute group.
  */
+static struct bin_attribute *g15_bin_attrs[] = {
+	&bin_attr_keymap_bin,
+	NULL,
+};
+
 static struct attribute_group g15_attr_group = {
 	.attrs = g15_attrs,
+	.bin_attrs = g15_bin_attrs,
 };
 
 
+static const struct ginput_key_field g15_key_fields[] = {
+	{ 1, 0xff,  0 },
+	{ 2, 0xff,  8 },
+	{ 3, 0xff, 16 },
+	{ 4, 0xfe, 24 },        /* bit 0 turns on and off at random */
+	{ 5, 0xff, 32 },
+	{ 6, 0xff, 40 },
+	{ 7, 0xff, 48 },
+	{ 8, 0xff, 56 },
+};
+
 static void g15_raw_event_process_input(struct hid_device *hdev,
                                         struct gcommon_data *gdata,
                                         u8 *raw_data)
 {
 	struct input_dev *idev = gdata->input_dev;
 	struct ginput_data *input_data = &gdata->input_data;
-	int scancode;
-	int value;
-	int i;
-	int mask;
 
 	/*
 	 * We'll check for the M* keys being pressed before processing
@@ -590,42 +608,11 @@ static void g15_raw_event_process_input(struct hid_device *hdev,
 			ginput_set_keymap_index(gdata, 2);
 	}
 
-	raw_data[4] &= 0xFE; /* This bit turns on and off at random */
-
-	for (i = 0, mask = 0x01; i < 8; i++, mask <<= 1) {
-		scancode = i;
-		value = raw_data[1] & mask;
-		ginput_handle_key_event(gdata, scancode, value);
-
-		scancode = i + 8;
-		value = raw_data[2] & mask;
-		ginput_handle_key_event(gdata, scancode, value);
-
-		scancode = i + 16;
-		value = raw_data[3] & mask;
-		ginput_handle_key_event(gdata, scancode, value);
-
-		scancode = i + 24;
-		value = raw_data[4] & mask;
-		ginput_handle_key_event(gdata, scancode, value);
-
-		scancode = i + 32;
-		value = raw_data[5] & mask;
-		ginput_handle_key_event(gdata, scancode, value);
-
-		scancode = i + 40;
-		value = raw_data[6] & mask;
-		ginput_handle_key_event(gdata, scancode, value);
-
-		scancode = i + 48;
-		value = raw_data[7] & mask;
-		ginput_handle_key_event(gdata, scancode, value);
-
-		scancode = i + 56;
-		value = raw_data[8] & mask;
-		ginput_handle_key_event(gdata, scancode, value);
-	}
+	ginput_handle_key_report(gdata, GINPUT_REPORT_KEYS,
+	                         g15_key_fields, ARRAY_SIZE(g15_key_fields),
+	                         raw_data);
 
+	trace_ginput_sync(gdata);
 	input_sync(idev);
 }
 
@@ -641,6 +628,8 @@ static int g15_raw_event(struct hid_device *hdev,
 	struct gcommon_data *gdata = dev_get_gdata(&hdev->dev);
 	struct g15_data *g15data = gdata->data;
 
+	trace_ginput_raw_event(hdev, report->id, size);
+
 	spin_lock_irqsave(&gdata->lock, irq_flags);
 
 	if (unlikely(g15data->need_reset)) {
@@ -690,18 +679,6 @@ static int g15_raw_event(struct hid_device *hdev,
 	return 0;
 }
 
-static void g15_initialize_keymap(struct gcommon_data *gdata)
-{
-	int i;
-
-	for (i = 0; i < G15_KEYS; i++) {
-		gdata->input_data.keycode[i] = g15_default_key_map[i];
-		__set_bit(gdata->input_data.keycode[i], gdata->input_dev->keybit);
-	}
-
-	__clear_bit(KEY_RESERVED, gdata->input_dev->keybit);
-}
-
 static int g15_probe(struct hid_device *hdev,
                      const struct hid_device_id *id)
 {
@@ -797,8 +774,6 @@ static int g15_probe(struct hid_device *hdev,
 	gdata->input_dev->id.product = hdev->product;
 	gdata->input_dev->id.version = hdev->version;
 	gdata->input_dev->dev.parent = hdev->dev.parent;
-	gdata->input_dev->keycode = gdata->input_data.keycode;
-	gdata->input_dev->keycodemax = G15_KEYMAP_SIZE;
 	gdata->input_dev->keycodesize = sizeof(int);
 	gdata->input_dev->setkeycode = ginput_setkeycode;
 	gdata->input_dev->getkeycode = ginput_getkeycode;
@@ -814,7 +789,7 @@ static int g15_probe(struct hid_device *hdev,
 		goto err_cleanup_input_dev;
 	}
 
-	g15_initialize_keymap(gdata);
+	ginput_init_keymap(gdata, g15_default_key_map);
 
 	error = input_register_device(gdata->input_dev);
 	if (error) {
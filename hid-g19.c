@@ -39,6 +39,7 @@
 #endif
 
 #include "hid-gcommon.h"
+#include "hid-ginput-trace.h"
 
 #ifdef __GNUC__
 #define __UNUSED __attribute__ ((unused))
@@ -50,7 +51,6 @@
 
 /* Key defines */
 #define G19_KEYS 32
-#define G19_KEYMAP_SIZE (G19_KEYS*3)
 
 /* Backlight defaults */
 #define G19_DEFAULT_RED (0)
@@ -481,13 +481,18 @@ static DEVICE_ATTR(keymap_switching, 0644,
                    ginput_keymap_switching_show,
                    ginput_keymap_switching_store);
 
+static BIN_ATTR(keymap_bin, 0644,
+                ginput_keymap_bin_read,
+                ginput_keymap_bin_write, 0);
+
 /* change leds when the keymap was changed */
 static void g19_notify_keymap_switched(struct gcommon_data * gdata,
                                        unsigned int index)
 {
 	struct g19_data *g19data = gdata->data;
 
-	g19data->led = 1 << index;
+	/* Only M1 to M3 have a LED */
+	g19data->led = index < 3 ? 1 << index : 0;
 	g19_led_send(gdata->hdev);
 }
 
@@ -612,21 +617,34 @@ static struct attribute *g19_attrs[] = {
  * created for the attributes with the directory being the name of the
  * attribute group.
  */
+static struct bin_attribute *g19_bin_attrs[] = {
+	&bin_attr_keymap_bin,
+	NULL,
+};
+
 static struct attribute_group g19_attr_group = {
 	.attrs = g19_attrs,
+	.bin_attrs = g19_bin_attrs,
 };
 
 
+static const struct ginput_key_field g19_key_fields[] = {
+	{ 1, 0xff,  0 },        /* Keys G1 through G8 */
+	{ 2, 0xff,  8 },        /* Keys G9 through G12, M1 through MR */
+	{ 3, 0xbf, 16 },        /* Keys G17 through G22; bit 6 is always on */
+};
+
+/* The keys sent on the ep1 interrupt endpoint */
+static const struct ginput_key_field g19_ep1_key_fields[] = {
+	{ 0, 0xff, 24 },
+};
+
 static void g19_raw_event_process_input(struct hid_device *hdev,
                                         struct gcommon_data *gdata,
                                         u8 *raw_data)
 {
 	struct input_dev *idev = gdata->input_dev;
 	struct ginput_data *input_data = &gdata->input_data;
-	int scancode;
-	int value;
-	int i;
-	int mask;
 
 	/*
 	 * We'll check for the M* keys being pressed before processing
@@ -641,25 +659,11 @@ static void g19_raw_event_process_input(struct hid_device *hdev,
 		else if (input_data->curkeymap != 2 && raw_data[2] & 0x40)
 			ginput_set_keymap_index(gdata, 2);
 	}
-	raw_data[3] &= 0xBF; /* bit 6 is always on */
-
-	for (i = 0, mask = 0x01; i < 8; i++, mask <<= 1) {
-		/* Keys G1 through G8 */
-		scancode = i;
-		value = raw_data[1] & mask;
-		ginput_handle_key_event(gdata, scancode, value);
-
-		/* Keys G9 through G12, M1 through MR */
-		scancode = i + 8;
-		value = raw_data[2] & mask;
-		ginput_handle_key_event(gdata, scancode, value);
-
-		/* Keys G17 through G22 */
-		scancode = i + 16;
-		value = raw_data[3] & mask;
-		ginput_handle_key_event(gdata, scancode, value);
-	}
+	ginput_handle_key_report(gdata, GINPUT_REPORT_KEYS,
+	                         g19_key_fields, ARRAY_SIZE(g19_key_fields),
+	                         raw_data);
 
+	trace_ginput_sync(gdata);
 	input_sync(idev);
 }
 
@@ -676,6 +680,8 @@ static int g19_raw_event(struct hid_device *hdev,
 	struct gcommon_data *gdata = dev_get_gdata(&hdev->dev);
 	struct g19_data *g19data = gdata->data;
 
+	trace_ginput_raw_event(hdev, report->id, size);
+
 	spin_lock_irqsave(&gdata->lock, irq_flags);
 
 	if (unlikely(g19data->ready_stages != G19_READY_STAGE_3)) {
@@ -718,18 +724,6 @@ static int g19_raw_event(struct hid_device *hdev,
 	return 0;
 }
 
-static void g19_initialize_keymap(struct gcommon_data *gdata)
-{
-	int i;
-
-	for (i = 0; i < G19_KEYS; i++) {
-		gdata->input_data.keycode[i] = g19_default_key_map[i];
-		__set_bit(gdata->input_data.keycode[i], gdata->input_dev->keybit);
-	}
-
-	__clear_bit(KEY_RESERVED, gdata->input_dev->keybit);
-}
-
 
 #ifdef CONFIG_PM
 
@@ -765,11 +759,12 @@ static void g19_ep1_urb_completion(struct urb *urb)
 		struct hid_device *hdev = urb->context;
 		struct gcommon_data *gdata = hid_get_gdata(hdev);
 		struct g19_data *g19data = gdata->data;
-		int i;
 
-		for (i = 0; i < 8; i++)
-			ginput_handle_key_event(gdata, 24+i, g19data->ep1keys[0]&(1<<i));
+		ginput_handle_key_report(gdata, GINPUT_REPORT_EP1,
+		                         g19_ep1_key_fields, ARRAY_SIZE(g19_ep1_key_fields),
+		                         g19data->ep1keys);
 
+		trace_ginput_sync(gdata);
 		input_sync(gdata->input_dev);
 
 		usb_submit_urb(urb, GFP_ATOMIC);
@@ -906,8 +901,6 @@ static int g19_probe(struct hid_device *hdev,
 	gdata->input_dev->id.product = hdev->product;
 	gdata->input_dev->id.version = hdev->version;
 	gdata->input_dev->dev.parent = hdev->dev.parent;
-	gdata->input_dev->keycode = gdata->input_data.keycode;
-	gdata->input_dev->keycodemax = G19_KEYMAP_SIZE;
 	gdata->input_dev->keycodesize = sizeof(unsigned int);
 	gdata->input_dev->setkeycode = ginput_setkeycode;
 	gdata->input_dev->getkeycode = ginput_getkeycode;
@@ -923,7 +916,7 @@ static int g19_probe(struct hid_device *hdev,
 		goto err_cleanup_input_dev;
 	}
 
-	g19_initialize_keymap(gdata);
+	ginput_init_keymap(gdata, g19_default_key_map);
 
 	error = input_register_device(gdata->input_dev);
 	if (error) {
@@ -39,6 +39,7 @@
 #endif
 
 #include "hid-gcommon.h"
+#include "hid-ginput-trace.h"
 
 #ifdef __GNUC__
 #define __UNUSED __attribute__ ((unused))
@@ -50,7 +51,6 @@
 
 /* Key defines */
 #define G510_KEYS 32
-#define G510_KEYMAP_SIZE (G510_KEYS*3)
 
 /* Backlight defaults */
 #define G510_DEFAULT_RED (0)
@@ -381,13 +381,18 @@ static DEVICE_ATTR(keymap_switching, 0644,
                    ginput_keymap_switching_show,
                    ginput_keymap_switching_store);
 
+static BIN_ATTR(keymap_bin, 0644,
+                ginput_keymap_bin_read,
+                ginput_keymap_bin_write, 0);
+
 /* change leds when the keymap was changed */
 static void g510_notify_keymap_switched(struct gcommon_data * gdata,
                                         unsigned int index)
 {
 	struct g510_data * g510data = gdata->data;
 
-	g510data->led = 1 << index;
+	/* Only M1 to M3 have a LED */
+	g510data->led = index < 3 ? 1 << index : 0;
 	g510_msg_send(gdata->hdev, 4, ~g510data->led, 0);
 }
 
@@ -513,8 +518,21 @@ static struct attribute *g510_attrs[] = {
  * created for the attributes with the directory being the name of the
  * attribute group.
  */
+static struct bin_attribute *g510_bin_attrs[] = {
+	&bin_attr_keymap_bin,
+	NULL,
+};
+
 static struct attribute_group g510_attr_group = {
 	.attrs = g510_attrs,
+	.bin_attrs = g510_bin_attrs,
+};
+
+static const struct ginput_key_field g510_key_fields[] = {
+	{ 1, 0xff,  0 },
+	{ 2, 0xff,  8 },
+	{ 3, 0xff, 16 },
+	{ 4, 0xfe, 24 },        /* bit 0 turns on and off at random - G510 - does it do this? seems safe to leave here in case */
 };
 
 static void g510_raw_event_process_input(struct hid_device *hdev,
@@ -523,10 +541,6 @@ static void g510_raw_event_process_input(struct hid_device *hdev,
 {
 	struct input_dev *idev = gdata->input_dev;
 	struct ginput_data *input_data = &gdata->input_data;
-	int scancode;
-	int value;
-	int i;
-	int mask;
 
 	/*
 	 * We'll check for the M* keys being pressed before processing
@@ -542,26 +556,11 @@ static void g510_raw_event_process_input(struct hid_device *hdev,
 			ginput_set_keymap_index(gdata, 2);
 	}
 
-	raw_data[4] &= 0xFE; /* This bit turns on and off at random - G510 - does it do this? seems safe to leave here in case */
-
-	for (i = 0, mask = 0x01; i < 8; i++, mask <<= 1) {
-		scancode = i;
-		value = raw_data[1] & mask;
-		ginput_handle_key_event(gdata, scancode, value);
-
-		scancode = i + 8;
-		value = raw_data[2] & mask;
-		ginput_handle_key_event(gdata, scancode, value);
-
-		scancode = i + 16;
-		value = raw_data[3] & mask;
-		ginput_handle_key_event(gdata, scancode, value);
-
-		scancode = i + 24;
-		value = raw_data[4] & mask;
-		ginput_handle_key_event(gdata, scancode, value);
-	}
+	ginput_handle_key_report(gdata, GINPUT_REPORT_KEYS,
+	                         g510_key_fields, ARRAY_SIZE(g510_key_fields),
+	                         raw_data);
 
+	trace_ginput_sync(gdata);
 	input_sync(idev);
 }
 
@@ -577,6 +576,8 @@ static int g510_raw_event(struct hid_device *hdev,
 	struct gcommon_data *gdata = dev_get_gdata(&hdev->dev);
 	struct g510_data *g510data = gdata->data;
 
+	trace_ginput_raw_event(hdev, report->id, size);
+
 	spin_lock_irqsave(&gdata->lock, irq_flags);
 
 	if (unlikely(g510data->need_reset)) {
@@ -626,18 +627,6 @@ static int g510_raw_event(struct hid_device *hdev,
 	return 0;
 }
 
-static void g510_initialize_keymap(struct gcommon_data *gdata)
-{
-	int i;
-
-	for (i = 0; i < G510_KEYS; i++) {
-		gdata->input_data.keycode[i] = g510_default_key_map[i];
-		__set_bit(gdata->input_data.keycode[i], gdata->input_dev->keybit);
-	}
-
-	__clear_bit(KEY_RESERVED, gdata->input_dev->keybit);
-}
-
 static int g510_probe(struct hid_device *hdev,
                       const struct hid_device_id *id)
 {
@@ -733,8 +722,6 @@ static int g510_probe(struct hid_device *hdev,
 	gdata->input_dev->id.product = hdev->product;
 	gdata->input_dev->id.version = hdev->version;
 	gdata->input_dev->dev.parent = hdev->dev.parent;
-	gdata->input_dev->keycode = gdata->input_data.keycode;
-	gdata->input_dev->keycodemax = G510_KEYMAP_SIZE;
 	gdata->input_dev->keycodesize = sizeof(int);
 	gdata->input_dev->setkeycode = ginput_setkeycode;
 	gdata->input_dev->getkeycode = ginput_getkeycode;
@@ -750,7 +737,7 @@ static int g510_probe(struct hid_device *hdev,
 		goto err_cleanup_input_dev;
 	}
 
-	g510_initialize_keymap(gdata);
+	ginput_init_keymap(gdata, g510_default_key_map);
 
 	error = input_register_device(gdata->input_dev);
 	if (error) {
@@ -0,0 +1,66 @@
+/***************************************************************************
+ *   Userspace interface of the Logitech G-series framebuffer             *
+ *                                                                         *
+ *   This program is free software: you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation, either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This driver is distributed in the hope that it will be useful, but    *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of            *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU      *
+ *   General Public License for more details.                              *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this software. If not see <http://www.gnu.org/licenses/>.  *
+ ***************************************************************************/
+#ifndef GFB_IOCTL_H_INCLUDED
+#define GFB_IOCTL_H_INCLUDED		1
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+/*
+ * Update modes
+ *
+ * In the deferred mode, writes to a mapping of the framebuffer are
+ * found through page faults and sent on their own. In the manual mode,
+ * mappings are not write protected and nothing is sent until the client
+ * flushes the area it drew with GFBIO_FLUSH. The mode applies to the
+ * mappings made after it is set.
+ */
+#define GFB_UPDATE_DEFERRED	0
+#define GFB_UPDATE_MANUAL	1
+
+/*
+ * var.nonstd value of the native layout
+ *
+ * The screen holds the image message payload exactly as the device
+ * takes it, and is sent without conversion:
+ *  - G19: RGB565 pixels column after column, each column top to bottom
+ *  - G13/G15: bands of 8 rows top to bottom, one byte per column of a
+ *    band with the top pixel in bit 0
+ * Each half of the double buffered screen holds one such payload from
+ * its first byte on.
+ */
+#define GFB_NONSTD_NATIVE	1
+
+/* Screen area, in pixels */
+struct gfb_update_rect {
+	__u16 x, y;
+	__u16 width, height;
+};
+
+#define GFB_FLUSH_MAX_RECTS	16
+
+/* Areas to send, clipped to the screen */
+struct gfb_flush {
+	__u32 count;            /* rects used, up to GFB_FLUSH_MAX_RECTS */
+	struct gfb_update_rect rects[GFB_FLUSH_MAX_RECTS];
+};
+
+#define GFBIO_GET_UPDATE_MODE	_IOR('g', 0x01, __u32)
+#define GFBIO_SET_UPDATE_MODE	_IOW('g', 0x02, __u32)
+#define GFBIO_FLUSH		_IOW('g', 0x03, struct gfb_flush)
+
+#endif
@@ -0,0 +1,129 @@
+/***************************************************************************
+ *   Tracepoints of the Logitech G-series framebuffer                     *
+ *                                                                         *
+ *   This program is free software: you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation, either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This driver is distributed in the hope that it will be useful, but    *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of            *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU      *
+ *   General Public License for more details.                              *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this software. If not see <http://www.gnu.org/licenses/>.  *
+ ***************************************************************************/
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM gfb
+
+#if !defined(GFB_TRACE_H_INCLUDED) || defined(TRACE_HEADER_MULTI_READ)
+#define GFB_TRACE_H_INCLUDED		1
+
+#include <linux/tracepoint.h>
+
+#include "hid-gfb.h"
+
+/*
+ * Every event carries the framebuffer minor (fb_info->node) and the
+ * panel type, so events of several panels can be told apart
+ */
+
+/* Damage about to be converted into the device layout */
+TRACE_EVENT(gfb_update_start,
+	TP_PROTO(struct gfb_data *data, const struct gfb_rect *damage),
+	TP_ARGS(data, damage),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(int, panel_type)
+		__field(int, x1)
+		__field(int, y1)
+		__field(int, x2)
+		__field(int, y2)
+	),
+	TP_fast_assign(
+		__entry->minor = data->fb_info->node;
+		__entry->panel_type = data->panel_type;
+		__entry->x1 = damage->x1;
+		__entry->y1 = damage->y1;
+		__entry->x2 = damage->x2;
+		__entry->y2 = damage->y2;
+	),
+	TP_printk("fb%d panel=%d damage=%d,%d-%d,%d",
+	          __entry->minor, __entry->panel_type,
+	          __entry->x1, __entry->y1, __entry->x2, __entry->y2)
+);
+
+/* Conversion done; changed is the area that differs from the last frame */
+TRACE_EVENT(gfb_update_end,
+	TP_PROTO(struct gfb_data *data, const struct gfb_rect *changed,
+	         int status),
+	TP_ARGS(data, changed, status),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(int, panel_type)
+		__field(int, x1)
+		__field(int, y1)
+		__field(int, x2)
+		__field(int, y2)
+		__field(int, status)
+	),
+	TP_fast_assign(
+		__entry->minor = data->fb_info->node;
+		__entry->panel_type = data->panel_type;
+		__entry->x1 = changed->x1;
+		__entry->y1 = changed->y1;
+		__entry->x2 = changed->x2;
+		__entry->y2 = changed->y2;
+		__entry->status = status;
+	),
+	TP_printk("fb%d panel=%d changed=%d,%d-%d,%d status=%d",
+	          __entry->minor, __entry->panel_type,
+	          __entry->x1, __entry->y1, __entry->x2, __entry->y2,
+	          __entry->status)
+);
+
+DECLARE_EVENT_CLASS(gfb_urb,
+	TP_PROTO(struct gfb_data *data, struct urb *urb, int status),
+	TP_ARGS(data, urb, status),
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(int, panel_type)
+		__field(const void *, urb)
+		__field(u32, length)
+		__field(u32, actual_length)
+		__field(int, status)
+	),
+	TP_fast_assign(
+		__entry->minor = data->fb_info->node;
+		__entry->panel_type = data->panel_type;
+		__entry->urb = urb;
+		__entry->length = urb->transfer_buffer_length;
+		__entry->actual_length = urb->actual_length;
+		__entry->status = status;
+	),
+	TP_printk("fb%d panel=%d urb=%p length=%u actual=%u status=%d",
+	          __entry->minor, __entry->panel_type, __entry->urb,
+	          __entry->length, __entry->actual_length, __entry->status)
+);
+
+/* An image message was submitted; status is the usb_submit_urb() result */
+DEFINE_EVENT(gfb_urb, gfb_urb_submit,
+	TP_PROTO(struct gfb_data *data, struct urb *urb, int status),
+	TP_ARGS(data, urb, status)
+);
+
+/* An image message completed; status is the urb status */
+DEFINE_EVENT(gfb_urb, gfb_urb_complete,
+	TP_PROTO(struct gfb_data *data, struct urb *urb, int status),
+	TP_ARGS(data, urb, status)
+);
+
+#endif
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE hid-gfb-trace
+#include <trace/define_trace.h>
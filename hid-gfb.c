@@ -16,8 +16,10 @@
  *   You should have received a copy of the GNU General Public License     *
  *   along with this software. If not see <http://www.gnu.org/licenses/>.  *
  ***************************************************************************/
+#include <linux/debugfs.h>
 #include <linux/fb.h>
 #include <linux/hid.h>
+#include <linux/hrtimer.h>
 #include <linux/init.h>
 #include <linux/input.h>
 #include <linux/mm.h>
@@ -27,9 +29,12 @@
 #include <linux/usb.h>
 #include <linux/vmalloc.h>
 #include <linux/leds.h>
+#include <linux/log2.h>
+#include <linux/seq_file.h>
 #include <linux/completion.h>
 #include <linux/delay.h>
 #include <linux/version.h>
+#include <asm/unaligned.h>
 
 #include "hid-ids.h"
 
@@ -40,11 +45,49 @@
 #endif
 
 #include "hid-gcommon.h"
+#include "hid-gfb-ioctl.h"
+
+#define CREATE_TRACE_POINTS
+#include "hid-gfb-trace.h"
+
 #define GFB_NAME "Logitech GamePanel Framebuffer"
 
 /* Framebuffer defines */
-#define GFB_UPDATE_RATE_LIMIT (30)
+#define GFB_MONO_UPDATE_RATE_LIMIT (30)
+#define GFB_QVGA_UPDATE_RATE_LIMIT (60)
 #define GFB_UPDATE_RATE_DEFAULT (30)
+/* Longest wait for a frame in FBIO_WAITFORVSYNC; covers 1 fps */
+#define GFB_FRAME_WAIT_TIMEOUT (2 * HZ)
+
+/* Panel geometries, which the conversions are specialized for */
+#define GFB_MONO_XRES (160)
+#define GFB_MONO_YRES (43)
+#define GFB_MONO_LINE_LENGTH (32)
+#define GFB_QVGA_XRES (320)
+#define GFB_QVGA_YRES (240)
+
+/*
+ * What differs between the panel types. gfb_probe() picks the
+ * descriptor of the panel once, the update path only goes through its
+ * hooks and data->fb_convert.
+ */
+struct gfb_panel {
+	struct fb_fix_screeninfo fix;
+	struct fb_var_screeninfo var;
+	size_t vbitmap_size;
+	unsigned update_rate_limit;
+	bool bulk;              /* bulk rather than interrupt endpoint */
+
+	/* Write the message header that stays the same into buf */
+	void (*init_message)(u8 *buf);
+	/* Build the message for window in buf; returns its length */
+	size_t (*pack)(struct gfb_data *data, const struct gfb_rect *window,
+	               u8 *buf);
+	/* Check the pixel format of var and fill in its bitfields */
+	int (*check_format)(struct fb_var_screeninfo *var);
+	/* Switch to the pixel format of fb_info->var and its converter */
+	void (*set_format)(struct gfb_data *data);
+};
 
 /* Convenience macros */
 #define dev_get_gfbdata(dev)                                    \
@@ -55,27 +98,280 @@ static uint32_t pseudo_palette[16];
 /* Forward decl. */
 static void gfb_free_data(struct kref *kref);
 
-/* Unlock the urb so we can reuse it */
+/* Holds a directory of counters per device */
+static struct dentry *gfb_debugfs_root;
+
+/* Count the time from start to end in a log2 histogram of microseconds */
+static void gfb_stats_hist_add(u64 *hist, ktime_t start, ktime_t end)
+{
+	s64 us = ktime_us_delta(end, start);
+	int bucket = us > 1 ? ilog2(us) : 0;
+
+	hist[min(bucket, GFB_STATS_HIST_SIZE - 1)]++;
+}
+
+/* Rectangle helpers */
+static inline bool gfb_rect_empty(const struct gfb_rect *rect)
+{
+	return rect->x1 >= rect->x2 || rect->y1 >= rect->y2;
+}
+
+static inline void gfb_rect_clear(struct gfb_rect *rect)
+{
+	rect->x1 = rect->y1 = rect->x2 = rect->y2 = 0;
+}
+
+/* Grow rect so that it also covers other */
+static inline void gfb_rect_union(struct gfb_rect *rect,
+                                  const struct gfb_rect *other)
+{
+	if (gfb_rect_empty(other))
+		return;
+
+	if (gfb_rect_empty(rect)) {
+		*rect = *other;
+		return;
+	}
+
+	rect->x1 = min(rect->x1, other->x1);
+	rect->y1 = min(rect->y1, other->y1);
+	rect->x2 = max(rect->x2, other->x2);
+	rect->y2 = max(rect->y2, other->y2);
+}
+
+/*
+ * G19 image message header. Bytes 3-4 hold the payload length in 256 byte
+ * units (0x0258 for the 153600 bytes of a whole frame). The window the
+ * pixel data is drawn into is stored as little endian 16 bit (x, y) start
+ * and end coordinates, both inclusive; the default one covers the whole
+ * 320x240 screen.
+ */
+#define GFB_QVGA_HDR_LENGTH	3
+#define GFB_QVGA_HDR_X1		7
+#define GFB_QVGA_HDR_Y1		9
+#define GFB_QVGA_HDR_X2		11
+#define GFB_QVGA_HDR_Y2		13
+
+/* G13/G15 image message header: the magic number, then zeroes */
+#define GFB_MONO_HDR_SIZE	32
+#define GFB_MONO_HDR_MAGIC	0x03
+
+char hdata[512] = {
+	0x10, 0x0f, 0x00, 0x58, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x3f, 0x01, 0xef, 0x00, 0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f, 0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x4b, 0x4c, 0x4d, 0x4e, 0x4f, 0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x5b, 0x5c, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x7b, 0x7c, 0x7d, 0x7e, 0x7f, 0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x8b, 0x8c, 0x8d, 0x8e, 0x8f, 0x90, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0x9b, 0x9c, 0x9d, 0x9e, 0x9f, 0xa0, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xab, 0xac, 0xad, 0xae, 0xaf, 0xb0, 0xb1, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xbb, 0xbc, 0xbd, 0xbe, 0xbf, 0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xcb, 0xcc, 0xcd, 0xce, 0xcf, 0xd0, 0xd1, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xdb, 0xdc, 0xdd, 0xde, 0xdf, 0xe0, 0xe1, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xeb, 0xec, 0xed, 0xee, 0xef, 0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f, 0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x4b, 0x4c, 0x4d, 0x4e, 0x4f, 0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x5b, 0x5c, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x7b, 0x7c, 0x7d, 0x7e, 0x7f, 0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x8b, 0x8c, 0x8d, 0x8e, 0x8f, 0x90, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0x9b, 0x9c, 0x9d, 0x9e, 0x9f, 0xa0, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xab, 0xac, 0xad, 0xae, 0xaf, 0xb0, 0xb1, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xbb, 0xbc, 0xbd, 0xbe, 0xbf, 0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xcb, 0xcc, 0xcd, 0xce, 0xcf, 0xd0, 0xd1, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xdb, 0xdc, 0xdd, 0xde, 0xdf, 0xe0, 0xe1, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xeb, 0xec, 0xed, 0xee, 0xef, 0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff
+};
+
+/*
+ * Sub-window messages have not been checked against G19 firmware, so they
+ * are opt-in; by default every message still carries the whole screen.
+ */
+static bool g19_partial_update;
+module_param(g19_partial_update, bool, 0644);
+MODULE_PARM_DESC(g19_partial_update, "Send only the changed window of G19 frames (experimental)");
+
+static void gfb_qvga_hdr_set(u8 *hdr, int offset, int value)
+{
+	hdr[offset] = value & 0xff;
+	hdr[offset + 1] = (value >> 8) & 0xff;
+}
+
+/*
+ * Build the G19 image message for window in buf, which already starts
+ * with hdata: rewrite the length and window fields of the header and
+ * append the pixels of the window in the column-major order of
+ * fb_vbitmap. The payload is zero padded to the 256 byte units of the
+ * length field. Returns the message length.
+ */
+static size_t gfb_fb_qvga_pack(struct gfb_data *data,
+                               const struct gfb_rect *window, u8 *buf)
+{
+	static const struct gfb_rect screen = {
+		0, 0, GFB_QVGA_XRES, GFB_QVGA_YRES
+	};
+	const int yres = GFB_QVGA_YRES;
+	int cols, rows;
+	size_t payload, padded;
+	u16 *src, *dst;
+	int col;
+
+	if (!g19_partial_update)
+		window = &screen;
+
+	cols = window->x2 - window->x1;
+	rows = window->y2 - window->y1;
+	payload = cols * rows * sizeof(u16);
+	padded = round_up(payload, 256);
+
+	gfb_qvga_hdr_set(buf, GFB_QVGA_HDR_LENGTH, padded / 256);
+	gfb_qvga_hdr_set(buf, GFB_QVGA_HDR_X1, window->x1);
+	gfb_qvga_hdr_set(buf, GFB_QVGA_HDR_Y1, window->y1);
+	gfb_qvga_hdr_set(buf, GFB_QVGA_HDR_X2, window->x2 - 1);
+	gfb_qvga_hdr_set(buf, GFB_QVGA_HDR_Y2, window->y2 - 1);
+
+	src = (u16 *)(data->fb_vbitmap + sizeof(hdata)) + window->x1 * yres + window->y1;
+	dst = (u16 *)(buf + sizeof(hdata));
+
+	if (rows == yres) {
+		/* Whole columns are contiguous */
+		memcpy(dst, src, cols * rows * sizeof(u16));
+	} else {
+		for (col = 0; col < cols; ++col) {
+			memcpy(dst, src, rows * sizeof(u16));
+			dst += rows;
+			src += yres;
+		}
+	}
+
+	memset(buf + sizeof(hdata) + payload, 0, padded - payload);
+
+	return sizeof(hdata) + padded;
+}
+
+/*
+ * Start the frame timer for the next frame slot, or right now if it's
+ * already past, unless a frame is pending anyway; fb_urb_lock held
+ */
+static void gfb_fb_arm_frame(struct gfb_data *data)
+{
+	ktime_t now, expires;
+
+	if (data->fb_frame_armed)
+		return;
+
+	now = ktime_get();
+	expires = data->fb_frame_due;
+	if (ktime_after(now, expires))
+		expires = now;
+	hrtimer_start(&data->fb_frame_timer, expires, HRTIMER_MODE_ABS);
+	data->fb_frame_armed = true;
+}
+
+/*
+ * Have the update work send fb_window in the next frame slot, even if
+ * nothing new is damaged by then
+ */
+static void gfb_fb_schedule_update(struct gfb_data *data)
+{
+	unsigned long irq_flags;
+
+	spin_lock_irqsave(&data->fb_urb_lock, irq_flags);
+	gfb_fb_arm_frame(data);
+	spin_unlock_irqrestore(&data->fb_urb_lock, irq_flags);
+}
+
+static void gfb_qvga_init_message(u8 *buf)
+{
+	memcpy(buf, &hdata, sizeof(hdata));
+}
+
+/* The G13/G15 only take whole frames, whatever the window */
+static size_t gfb_fb_mono_pack(struct gfb_data *data,
+                               const struct gfb_rect *window, u8 *buf)
+{
+	memcpy(buf + GFB_MONO_HDR_SIZE, data->fb_vbitmap + GFB_MONO_HDR_SIZE,
+	       data->fb_vbitmap_size - GFB_MONO_HDR_SIZE);
+
+	return data->fb_vbitmap_size;
+}
+
+static void gfb_mono_init_message(u8 *buf)
+{
+	memset(buf, 0x00, GFB_MONO_HDR_SIZE);
+	buf[0] = GFB_MONO_HDR_MAGIC;
+}
+
+/* Give the frame back to the ring so we can reuse it */
 static void gfb_fb_urb_completion(struct urb *urb)
 {
-	/* we need to unlock fb_vbitmap regardless of urb success status */
+	/* we need to release the frame regardless of urb success status */
 	unsigned long irq_flags;
-	struct gfb_data *data = urb->context;
+	struct gfb_frame *frame = urb->context;
+	struct gfb_data *data = frame->data;
+
+	trace_gfb_urb_complete(data, urb, urb->status);
 
 	spin_lock_irqsave(&data->fb_urb_lock, irq_flags);
-	data->fb_vbitmap_busy = false;
+	data->fb_stats.completed++;
+	gfb_stats_hist_add(data->fb_stats.latency_hist, frame->submitted,
+	                   ktime_get());
+
+	/* The panel missed this window, send it again with the next one */
+	if (unlikely(urb->status)) {
+		if (-urb->status > 0 && -urb->status < GFB_STATS_ERRNO_MAX)
+			data->fb_stats.urb_errors[-urb->status]++;
+		else
+			data->fb_stats.urb_errors[0]++;
+		gfb_rect_union(&data->fb_window, &frame->window);
+	}
+	frame->busy = false;
+
+	switch (urb->status) {
+	case 0:
+	case -ENOENT:      /* killed */
+	case -ECONNRESET:  /* unlinked */
+	case -ESHUTDOWN:   /* device gone */
+		break;
+	default:
+		data->fb_send_pending = true;
+		break;
+	}
+
+	/* Wake FBIO_WAITFORVSYNC */
+	data->fb_frame_seq++;
+	wake_up_interruptible_all(&data->fb_frame_wait);
+
+	/*
+	 * A newer frame was waiting for this one, send it right away. We
+	 * are in interrupt context, so leave building it to the workqueue.
+	 */
+	if (data->fb_send_pending) {
+		data->fb_send_pending = false;
+		schedule_work(&data->fb_send_work);
+	}
 	spin_unlock_irqrestore(&data->fb_urb_lock, irq_flags);
 }
 
-/* Send the current framebuffer vbitmap as an interrupt message */
-static int gfb_fb_send(struct gfb_data *data)
+/* Is any frame of the ring in flight? fb_urb_lock held */
+static bool gfb_fb_in_flight(struct gfb_data *data)
 {
-	struct usb_interface *intf;
-	struct usb_device *usb_dev;
-	struct hid_device *hdev = data->hdev;
+	int i;
 
-	struct usb_host_endpoint *ep;
-	unsigned int pipe;
+	for (i = 0; i < GFB_FRAME_RING; i++)
+		if (data->fb_frames[i].busy)
+			return true;
+
+	return false;
+}
+
+/* Find a frame of the ring that is not in flight; fb_urb_lock held */
+static struct gfb_frame *gfb_fb_get_frame(struct gfb_data *data)
+{
+	struct gfb_frame *frame;
+	int i;
+
+	for (i = 0; i < GFB_FRAME_RING; i++) {
+		frame = &data->fb_frames[(data->fb_frame_next + i) % GFB_FRAME_RING];
+		if (!frame->busy) {
+			data->fb_frame_next = (frame - data->fb_frames + 1) % GFB_FRAME_RING;
+			return frame;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Send the changed part of the framebuffer vbitmap as an interrupt
+ * (G13/G15) or bulk (G19) message
+ *
+ * Every message is built in its own frame of the ring, so the next
+ * conversion into fb_vbitmap can run while earlier frames are still in
+ * flight. Called with fb_vbitmap_lock held, which keeps conversions out
+ * of fb_vbitmap while it is packed and the messages in window order.
+ */
+static int gfb_fb_send(struct gfb_data *data)
+{
+	struct gfb_frame *frame;
+	size_t length;
 	int retval = 0;
 	unsigned long irq_flags;
 
@@ -83,174 +379,809 @@ static int gfb_fb_send(struct gfb_data *data)
 	if (data->virtualized)
 		return -ENODEV;
 
+	spin_lock_irqsave(&data->fb_urb_lock, irq_flags);
+
+	/*
+	 * Nothing changed since the last message: the converted frame is
+	 * the one the device already shows, so don't send it again.
+	 */
+	if (gfb_rect_empty(&data->fb_window)) {
+		data->fb_stats.unchanged++;
+		/*
+		 * As far as a waiter is concerned, that frame is done, unless
+		 * an earlier one is still in flight; its completion wakes them.
+		 */
+		if (!gfb_fb_in_flight(data)) {
+			data->fb_frame_seq++;
+			wake_up_interruptible_all(&data->fb_frame_wait);
+		}
+		spin_unlock_irqrestore(&data->fb_urb_lock, irq_flags);
+		return 0;
+	}
+
 	/*
-	 * Try and lock the framebuffer urb to prevent access if we have
-	 * submitted it. If we can't lock it we'll have to delay this update
-	 * until the next framebuffer interval.
-	 *
-	 * Fortunately, we already have the infrastructure in place with the
-	 * framebuffer deferred I/O driver to schedule the delayed update.
+	 * If the whole ring is in flight, the next completion sends this
+	 * update. The changed window stays in fb_window, so whatever is
+	 * newest by then gets sent.
 	 */
+	frame = gfb_fb_get_frame(data);
+	if (unlikely(frame == NULL)) {
+		data->fb_stats.busy++;
+		data->fb_send_pending = true;
+		spin_unlock_irqrestore(&data->fb_urb_lock, irq_flags);
+		return 0;
+	}
 
+	/*
+	 * Reserve the frame and take the window, then build the message
+	 * with the lock dropped; packing a G19 frame is a 150k copy.
+	 */
+	data->fb_stats.submitted++;
+	frame->busy = true;
+	frame->window = data->fb_window;
+	gfb_rect_clear(&data->fb_window);
+	spin_unlock_irqrestore(&data->fb_urb_lock, irq_flags);
+
+	/*
+	 * The urb was filled in at probe time and the message header is
+	 * already in its buffer; only the payload and its length change.
+	 */
+	length = data->fb_panel->pack(data, &frame->window, frame->buf);
+
+	frame->urb->transfer_buffer_length = length;
+	frame->urb->actual_length = 0;
+	frame->submitted = ktime_get();
+
+	retval = usb_submit_urb(frame->urb, GFP_KERNEL);
+	trace_gfb_urb_submit(data, frame->urb, retval);
+	if (unlikely(retval < 0))
+		goto err_release;
+
+	return 0;
+
+err_release:
+	/*
+	 * gfb_fb_urb_completion() won't be called for this frame. Free it
+	 * and put the window back for the next interval.
+	 */
 	spin_lock_irqsave(&data->fb_urb_lock, irq_flags);
-	if (likely(!data->fb_vbitmap_busy)) {
-		/* Get the usb device to send the image on */
-		intf = to_usb_interface(hdev->dev.parent);
-		usb_dev = interface_to_usbdev(intf);
-
-		switch (data->panel_type) {
-		case GFB_PANEL_TYPE_160_43_1:
-			pipe = usb_sndintpipe(usb_dev, 0x02);
-			break;
-		case GFB_PANEL_TYPE_320_240_16:
-			pipe = usb_sndbulkpipe(usb_dev, 0x02);
-			break;
-		default:
-			spin_unlock_irqrestore(&data->fb_urb_lock, irq_flags);
-			return -EINVAL;
+	data->fb_stats.submit_errors++;
+	gfb_rect_union(&data->fb_window, &frame->window);
+	frame->busy = false;
+	spin_unlock_irqrestore(&data->fb_urb_lock, irq_flags);
+	gfb_fb_schedule_update(data);
+	return retval;
+}
+
+/* Send the update that waited for a free frame */
+static void gfb_fb_send_work(struct work_struct *work)
+{
+	struct gfb_data *data = container_of(work, struct gfb_data,
+	                                     fb_send_work);
+
+	mutex_lock(&data->fb_vbitmap_lock);
+	gfb_fb_send(data);
+	mutex_unlock(&data->fb_vbitmap_lock);
+}
+
+
+/*
+ * The G19 frame is rotated in square tiles so that the rows being read
+ * and the columns being written stay in cache; screen sizes are a
+ * multiple of the tile size.
+ */
+#define GFB_QVGA_TILE 8
+
+/*
+ * Transpose a 4x4 block of 16 bit pixels into dst: the four pixels of
+ * each of the rows r0..r3 become the four pixels of each of four columns
+ * of dst. Each row and column is one 64 bit word with pixel i in bits
+ * 16*i..16*i+15, and the block is transposed within the registers.
+ * Returns the bits of dst that changed.
+ */
+static inline u64 gfb_qvga_transpose4x4(u64 r0, u64 r1, u64 r2, u64 r3,
+                                        u16 *dst, int yres)
+{
+	const u64 m16 = 0x0000ffff0000ffffULL;
+	const u64 m32 = 0x00000000ffffffffULL;
+	__le64 *d0 = (__le64 *)dst;
+	__le64 *d1 = (__le64 *)(dst + yres);
+	__le64 *d2 = (__le64 *)(dst + 2 * yres);
+	__le64 *d3 = (__le64 *)(dst + 3 * yres);
+	u64 t0, t1, t2, t3;
+	__le64 c0, c1, c2, c3;
+	u64 diff;
+
+	/* Interleave the pixels of rows 0/1 and 2/3 ... */
+	t0 = (r0 & m16) | ((r1 & m16) << 16);
+	t1 = ((r0 >> 16) & m16) | (r1 & ~m16);
+	t2 = (r2 & m16) | ((r3 & m16) << 16);
+	t3 = ((r2 >> 16) & m16) | (r3 & ~m16);
+
+	/* ... then the resulting pixel pairs */
+	c0 = cpu_to_le64((t0 & m32) | (t2 << 32));
+	c1 = cpu_to_le64((t1 & m32) | (t3 << 32));
+	c2 = cpu_to_le64((t0 >> 32) | (t2 & ~m32));
+	c3 = cpu_to_le64((t1 >> 32) | (t3 & ~m32));
+
+	diff = (__force u64)((*d0 ^ c0) | (*d1 ^ c1) | (*d2 ^ c2) | (*d3 ^ c3));
+
+	*d0 = c0;
+	*d1 = c1;
+	*d2 = c2;
+	*d3 = c3;
+
+	return diff;
+}
+
+/* Rotate a 4x4 block of RGB565 pixels from src into dst */
+static inline u64 gfb_qvga_rotate4x4(const u16 *src, u16 *dst,
+                                     int xres, int yres)
+{
+	return gfb_qvga_transpose4x4(le64_to_cpup((const __le64 *)src),
+	                             le64_to_cpup((const __le64 *)(src + xres)),
+	                             le64_to_cpup((const __le64 *)(src + 2 * xres)),
+	                             le64_to_cpup((const __le64 *)(src + 3 * xres)),
+	                             dst, yres);
+}
+
+/*
+ * Pack four XRGB8888 pixels into one word of RGB565 pixels. Each load
+ * brings two pixels, which are packed side by side in the one register.
+ */
+static inline u64 gfb_qvga_pack565x4(const u32 *src)
+{
+	const u64 mr = 0x0000f8000000f800ULL;
+	const u64 mg = 0x000007e0000007e0ULL;
+	const u64 mb = 0x0000001f0000001fULL;
+	u64 p01, p23;
+
+	p01 = le64_to_cpup((const __le64 *)src);
+	p23 = le64_to_cpup((const __le64 *)(src + 2));
+
+	/* pixel 2*i+j ends up in bits 32*j..32*j+15 */
+	p01 = ((p01 >> 8) & mr) | ((p01 >> 5) & mg) | ((p01 >> 3) & mb);
+	p23 = ((p23 >> 8) & mr) | ((p23 >> 5) & mg) | ((p23 >> 3) & mb);
+
+	return (p01 & 0xffff) | ((p01 >> 16) & 0xffff0000ULL) |
+	       ((p23 & 0xffff) << 32) | ((p23 >> 32) << 48);
+}
+
+/*
+ * Rotate a 4x4 block of XRGB8888 pixels from src into dst, packing them
+ * to RGB565 on the way so each source pixel is read once
+ */
+static inline u64 gfb_qvga_rotate4x4_xrgb(const u32 *src, u16 *dst,
+                                          int xres, int yres)
+{
+	return gfb_qvga_transpose4x4(gfb_qvga_pack565x4(src),
+	                             gfb_qvga_pack565x4(src + xres),
+	                             gfb_qvga_pack565x4(src + 2 * xres),
+	                             gfb_qvga_pack565x4(src + 3 * xres),
+	                             dst, yres);
+}
+
+/*
+ * Update fb_vbitmap from the screen_base
+ *
+ * Only the tiles touching the damage rectangle are rotated, the rest of
+ * fb_vbitmap still holds the previous frame. The bounding rectangle of
+ * the tiles that actually changed is returned in changed. The screen is
+ * RGB565, or XRGB8888 at 32 bpp which is packed within the rotation.
+ *
+ * This is only ever inlined into the converters below with a constant
+ * geometry and pixel format, so the strides and bounds fold into the
+ * code and the format test goes away.
+ */
+static __always_inline void gfb_qvga_convert(struct gfb_data *data,
+                                             const u8 *screen,
+                                             const struct gfb_rect *damage,
+                                             struct gfb_rect *changed,
+                                             const int xres, const int yres,
+                                             const bool xrgb)
+{
+	int col0, row0, col, row;
+	const u16 *src = (const u16 *)screen;
+	const u32 *src32 = (const u32 *)screen;
+	u16 *dst = (u16 *)(data->fb_vbitmap + sizeof(hdata));
+	u64 diff;
+	struct gfb_rect tile;
+
+	gfb_rect_clear(changed);
+
+	/* LCD is a portrait mode one so we have to rotate the framebuffer */
+
+	for (col0 = round_down(damage->x1, GFB_QVGA_TILE);
+	     col0 < damage->x2; col0 += GFB_QVGA_TILE) {
+		for (row0 = round_down(damage->y1, GFB_QVGA_TILE);
+		     row0 < damage->y2; row0 += GFB_QVGA_TILE) {
+			diff = 0;
+			for (col = col0; col < col0 + GFB_QVGA_TILE; col += 4)
+				for (row = row0; row < row0 + GFB_QVGA_TILE; row += 4)
+					if (xrgb)
+						diff |= gfb_qvga_rotate4x4_xrgb(src32 + row * xres + col,
+						                                dst + col * yres + row,
+						                                xres, yres);
+					else
+						diff |= gfb_qvga_rotate4x4(src + row * xres + col,
+						                           dst + col * yres + row,
+						                           xres, yres);
+
+			if (diff) {
+				tile.x1 = col0;
+				tile.y1 = row0;
+				tile.x2 = col0 + GFB_QVGA_TILE;
+				tile.y2 = row0 + GFB_QVGA_TILE;
+				gfb_rect_union(changed, &tile);
+			}
 		}
+	}
+}
 
-		ep = (usb_pipein(pipe) ? usb_dev->ep_in : usb_dev->ep_out)[usb_pipeendpoint(pipe)];
+static void gfb_fb_qvga_update(struct gfb_data *data, const u8 *screen,
+                               const struct gfb_rect *damage,
+                               struct gfb_rect *changed)
+{
+	gfb_qvga_convert(data, screen, damage, changed,
+	                 GFB_QVGA_XRES, GFB_QVGA_YRES, false);
+}
 
-		if (unlikely(!ep)) {
-			spin_unlock_irqrestore(&data->fb_urb_lock, irq_flags);
-			return -ENODEV;
+static void gfb_fb_qvga_xrgb_update(struct gfb_data *data, const u8 *screen,
+                                    const struct gfb_rect *damage,
+                                    struct gfb_rect *changed)
+{
+	gfb_qvga_convert(data, screen, damage, changed,
+	                 GFB_QVGA_XRES, GFB_QVGA_YRES, true);
+}
+
+/*
+ * Transpose an 8x8 bit matrix stored one row per byte, least significant
+ * byte first: bit c of byte r ends up as bit r of byte c. This is the
+ * three step swap from Hacker's Delight, 7-3.
+ */
+static inline u64 gfb_transpose8x8(u64 x)
+{
+	u64 t;
+
+	t = (x ^ (x >> 7)) & 0x00aa00aa00aa00aaULL;
+	x = x ^ t ^ (t << 7);
+	t = (x ^ (x >> 14)) & 0x0000cccc0000ccccULL;
+	x = x ^ t ^ (t << 14);
+	t = (x ^ (x >> 28)) & 0x00000000f0f0f0f0ULL;
+	x = x ^ t ^ (t << 28);
+
+	return x;
+}
+
+/*
+ * 8x8 Bayer matrix for the ordered dithering of the 8 bpp grayscale
+ * screen, as 7 bit thresholds 2 * b + 1 so that a whole row of eight
+ * pixels can be compared in one 64 bit word.
+ */
+static const u8 gfb_mono_bayer8x8[8][8] = {
+	{   1,  65,  17,  81,   5,  69,  21,  85 },
+	{  97,  33, 113,  49, 101,  37, 117,  53 },
+	{  25,  89,   9,  73,  29,  93,  13,  77 },
+	{ 121,  57, 105,  41, 125,  61, 109,  45 },
+	{   7,  71,  23,  87,   3,  67,  19,  83 },
+	{ 103,  39, 119,  55,  99,  35, 115,  51 },
+	{  31,  95,  15,  79,  27,  91,  11,  75 },
+	{ 127,  63, 111,  47, 123,  59, 107,  43 },
+};
+
+/*
+ * Build the 8 output bytes of a byte column of a band from the XBM
+ * screen_base.
+ *
+ * Translate the XBM format screen_base into the format needed by the
+ * G15. This format places the pixels in a vertical rather than
+ * horizontal format. Assuming a grid with 0,0 in the upper left corner
+ * and 159,42 in the lower right corner, the first byte contains the
+ * pixels 0,0 through 0,7 and the second byte contains the pixels 1,0
+ * through 1,7. Within the byte, bit 0 represents 0,0; bit 1 0,1; etc.
+ *
+ * Each XBM byte holds 8 horizontal pixels with the leftmost one in
+ * bit 0, so the 8 bytes of a byte column within a band form an 8x8
+ * bit matrix whose transpose is the 8 output bytes of those columns.
+ */
+static __always_inline u64 gfb_mono_block_xbm(const u8 *src, const int ll,
+                                              const int rows)
+{
+	u64 block = 0;
+	int row;
+
+	for (row = 0; row < rows; ++row)
+		block |= (u64)src[row * ll] << (row * 8);
+
+	return gfb_transpose8x8(block);
+}
+
+/*
+ * Build the 8 output bytes of 8 columns of a band from the 8 bpp
+ * grayscale screen_base.
+ *
+ * 0 is black and 255 white. A pixel is lit when its gray level, cut to
+ * 7 bits, is below the Bayer threshold of its position. The bands start
+ * at multiples of 8 rows and the byte columns at multiples of 8 pixels,
+ * so row r of a block always meets row r of the matrix.
+ *
+ * Each row of a block is one word of eight pixels. Setting the top bit
+ * of every byte and subtracting the thresholds leaves the top bit clear
+ * exactly where a pixel is below its threshold, without borrows between
+ * the bytes. That bit, moved to bit r, is bit r of the column byte, so
+ * dithering and banding come out of the same pass with no transpose.
+ */
+static __always_inline u64 gfb_mono_block_gray(const u8 *src, const int ll,
+                                               const int rows)
+{
+	const u64 h = 0x8080808080808080ULL;
+	const u64 l7 = 0x7f7f7f7f7f7f7f7fULL;
+	u64 block = 0;
+	u64 gray, lit;
+	int row;
+
+	for (row = 0; row < rows; ++row) {
+		gray = (get_unaligned_le64(src + row * ll) >> 1) & l7;
+		lit = ~((gray | h) - get_unaligned_le64(gfb_mono_bayer8x8[row])) & h;
+		block |= lit >> (7 - row);
+	}
+
+	return block;
+}
+
+/*
+ * Convert the byte columns col81..col82 of a band of rows pixels,
+ * comparing each block with the one already in fb_vbitmap
+ */
+static __always_inline void gfb_mono_band(struct gfb_data *data,
+                                          const u8 *screen, int band,
+                                          int col81, int col82,
+                                          struct gfb_rect *changed,
+                                          const int xres, const int ll,
+                                          const int rows, const bool gray)
+{
+	u8 *dst = data->fb_vbitmap + GFB_MONO_HDR_SIZE + band * xres;
+	const u8 *src = screen + band * 8 * ll;
+	struct gfb_rect tile;
+	u64 block;
+	int col8;
+
+	for (col8 = col81; col8 < col82; ++col8) {
+		if (gray)
+			block = gfb_mono_block_gray(src + col8 * 8, ll, rows);
+		else
+			block = gfb_mono_block_xbm(src + col8, ll, rows);
+
+		if (get_unaligned_le64(dst + col8 * 8) == block)
+			continue;
+		put_unaligned_le64(block, dst + col8 * 8);
+
+		tile.x1 = col8 * 8;
+		tile.y1 = band * 8;
+		tile.x2 = tile.x1 + 8;
+		tile.y2 = tile.y1 + rows;
+		gfb_rect_union(changed, &tile);
+	}
+}
+
+/*
+ * Update fb_vbitmap from the screen_base
+ *
+ * Only the bands and byte columns touched by the damage are redone;
+ * xres is a multiple of 8. The bounding rectangle of the blocks that
+ * differ from fb_vbitmap is returned in changed. The offset is adjusted
+ * by 32 within the image message.
+ *
+ * Like gfb_qvga_convert() this is only inlined with a constant geometry
+ * and format. The full bands then convert with a constant row count and
+ * unroll, and the short last band gets a loop of its own.
+ */
+static __always_inline void gfb_mono_convert(struct gfb_data *data,
+                                             const u8 *screen,
+                                             const struct gfb_rect *damage,
+                                             struct gfb_rect *changed,
+                                             const int xres, const int yres,
+                                             const int ll, const bool gray)
+{
+	const int full_bands = yres / 8;
+	int band, band1, band2, col81, col82;
+
+	gfb_rect_clear(changed);
+
+	band1 = damage->y1 / 8;
+	band2 = DIV_ROUND_UP(damage->y2, 8);
+	col81 = damage->x1 / 8;
+	col82 = DIV_ROUND_UP(damage->x2, 8);
+
+	for (band = band1; band < min(band2, full_bands); ++band)
+		gfb_mono_band(data, screen, band, col81, col82, changed,
+		              xres, ll, 8, gray);
+
+	if (yres % 8 && band2 > full_bands)
+		gfb_mono_band(data, screen, full_bands, col81, col82, changed,
+		              xres, ll, yres % 8, gray);
+}
+
+static void gfb_fb_mono_update(struct gfb_data *data, const u8 *screen,
+                               const struct gfb_rect *damage,
+                               struct gfb_rect *changed)
+{
+	gfb_mono_convert(data, screen, damage, changed, GFB_MONO_XRES,
+	                 GFB_MONO_YRES, GFB_MONO_LINE_LENGTH, false);
+}
+
+static void gfb_fb_mono_gray_update(struct gfb_data *data, const u8 *screen,
+                                    const struct gfb_rect *damage,
+                                    struct gfb_rect *changed)
+{
+	gfb_mono_convert(data, screen, damage, changed, GFB_MONO_XRES,
+	                 GFB_MONO_YRES, GFB_MONO_XRES, true);
+}
+
+/*
+ * Update fb_vbitmap from a screen_base already in the device layout
+ *
+ * In the native mode the client lays out the screen the way the device
+ * takes it: the G19 payload column after column, the G13/G15 payload
+ * band after band. There is nothing to convert, the screen is copied
+ * where it differs and the changed area worked out from the offsets.
+ * The damage is not looked at since its rows are rows of bytes in the
+ * buffer rather than rows of pixels; the whole screen is compared.
+ */
+static void gfb_fb_qvga_native_update(struct gfb_data *data, const u8 *screen,
+                                      const struct gfb_rect *damage,
+                                      struct gfb_rect *changed)
+{
+	const u64 *src = (const u64 *)screen;
+	u64 *dst = (u64 *)(data->fb_vbitmap + sizeof(hdata));
+	struct gfb_rect tile;
+	int col, row;
+
+	gfb_rect_clear(changed);
+
+	/* each word holds 4 pixels of a column */
+	for (col = 0; col < GFB_QVGA_XRES; ++col) {
+		for (row = 0; row < GFB_QVGA_YRES; row += 4, ++src, ++dst) {
+			if (*dst == *src)
+				continue;
+			*dst = *src;
+
+			tile.x1 = col;
+			tile.y1 = row;
+			tile.x2 = col + 1;
+			tile.y2 = row + 4;
+			gfb_rect_union(changed, &tile);
 		}
+	}
+}
 
-		switch (data->panel_type) {
-		case GFB_PANEL_TYPE_160_43_1:
-			usb_fill_int_urb(data->fb_urb, usb_dev, pipe, data->fb_vbitmap, data->fb_vbitmap_size,
-			                 gfb_fb_urb_completion, data, ep->desc.bInterval);
-			break;
-		case GFB_PANEL_TYPE_320_240_16:
-			usb_fill_bulk_urb(data->fb_urb, usb_dev, pipe, data->fb_vbitmap, data->fb_vbitmap_size,
-			                  gfb_fb_urb_completion, data);
-			break;
-		default:
-			spin_unlock_irqrestore(&data->fb_urb_lock, irq_flags);
-			return -EINVAL;
+static void gfb_fb_mono_native_update(struct gfb_data *data, const u8 *screen,
+                                      const struct gfb_rect *damage,
+                                      struct gfb_rect *changed)
+{
+	const u64 *src = (const u64 *)screen;
+	u64 *dst = (u64 *)(data->fb_vbitmap + GFB_MONO_HDR_SIZE);
+	struct gfb_rect tile;
+	int band, col8;
+
+	gfb_rect_clear(changed);
+
+	/* each word holds 8 columns of a band */
+	for (band = 0; band < DIV_ROUND_UP(GFB_MONO_YRES, 8); ++band) {
+		for (col8 = 0; col8 < GFB_MONO_XRES / 8; ++col8, ++src, ++dst) {
+			if (*dst == *src)
+				continue;
+			*dst = *src;
+
+			tile.x1 = col8 * 8;
+			tile.y1 = band * 8;
+			tile.x2 = tile.x1 + 8;
+			tile.y2 = min(tile.y1 + 8, GFB_MONO_YRES);
+			gfb_rect_union(changed, &tile);
 		}
+	}
+}
+
+/*
+ * Convert the damaged area of the screen image at screen and send the
+ * frame; a NULL damage rectangle means the whole screen
+ */
+static int gfb_fb_update(struct gfb_data *data, const u8 *screen,
+                         const struct gfb_rect *damage)
+{
+	struct gfb_rect full = {
+		.x1 = 0,
+		.y1 = 0,
+		.x2 = data->fb_info->var.xres,
+		.y2 = data->fb_info->var.yres,
+	};
+	struct gfb_rect changed;
+	unsigned long irq_flags;
+	ktime_t start, end;
+	int retval;
+
+	if (damage == NULL)
+		damage = &full;
+
+	trace_gfb_update_start(data, damage);
+
+	/* An earlier message may still be packed from fb_vbitmap */
+	mutex_lock(&data->fb_vbitmap_lock);
+
+	start = ktime_get();
+	data->fb_convert(data, screen, damage, &changed);
+	end = ktime_get();
+
+	/* Queue the changed area for the next message */
+	spin_lock_irqsave(&data->fb_urb_lock, irq_flags);
+	data->fb_stats.converted++;
+	gfb_stats_hist_add(data->fb_stats.convert_hist, start, end);
+	gfb_rect_union(&data->fb_window, &changed);
+	spin_unlock_irqrestore(&data->fb_urb_lock, irq_flags);
+
+	retval = gfb_fb_send(data);
+
+	mutex_unlock(&data->fb_vbitmap_lock);
+
+	trace_gfb_update_end(data, &changed, retval);
+
+	return retval;
+}
+
+static int gfb_mono_check_format(struct fb_var_screeninfo *var)
+{
+	if (var->bits_per_pixel == 8 && var->nonstd == 0)
+		var->grayscale = 1;
+	else if (var->bits_per_pixel == 1)
+		var->grayscale = 0;
+	else
+		return -EINVAL;
+
+	return 0;
+}
+
+static void gfb_mono_set_format(struct gfb_data *data)
+{
+	struct fb_info *info = data->fb_info;
+
+	if (info->var.bits_per_pixel == 8) {
+		info->fix.line_length = GFB_MONO_XRES;
+		info->fix.visual = FB_VISUAL_STATIC_PSEUDOCOLOR;
+		data->fb_convert = gfb_fb_mono_gray_update;
+	} else {
+		info->fix.line_length = GFB_MONO_LINE_LENGTH;
+		info->fix.visual = FB_VISUAL_MONO01;
+		data->fb_convert = data->fb_native ? gfb_fb_mono_native_update
+		                                   : gfb_fb_mono_update;
+	}
+}
+
+static int gfb_qvga_check_format(struct fb_var_screeninfo *var)
+{
+	if (var->bits_per_pixel == 32 && var->nonstd == 0) {
+		var->red    = (struct fb_bitfield) {16, 8, 0};
+		var->green  = (struct fb_bitfield) { 8, 8, 0};
+		var->blue   = (struct fb_bitfield) { 0, 8, 0};
+		var->transp = (struct fb_bitfield) { 0, 0, 0};
+	} else if (var->bits_per_pixel == 16) {
+		var->red    = (struct fb_bitfield) {11, 5, 0};
+		var->green  = (struct fb_bitfield) { 5, 6, 0};
+		var->blue   = (struct fb_bitfield) { 0, 5, 0};
+		var->transp = (struct fb_bitfield) { 0, 0, 0};
+	} else {
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static void gfb_qvga_set_format(struct gfb_data *data)
+{
+	struct fb_info *info = data->fb_info;
+
+	info->fix.line_length = GFB_QVGA_XRES * info->var.bits_per_pixel / 8;
+	if (data->fb_native)
+		data->fb_convert = gfb_fb_qvga_native_update;
+	else if (info->var.bits_per_pixel == 32)
+		data->fb_convert = gfb_fb_qvga_xrgb_update;
+	else
+		data->fb_convert = gfb_fb_qvga_update;
+}
+
+/*
+ * Indexed by panel type. The G13/G15 panels sit behind an interrupt
+ * endpoint polled at a fixed interval, the G19 takes its frames over
+ * bulk and can go faster.
+ */
+static const struct gfb_panel gfb_panels[] = {
+	[GFB_PANEL_TYPE_160_43_1] = {
+		.fix = {
+			.id = "GFB_MONO",
+			.type = FB_TYPE_PACKED_PIXELS,
+			.visual = FB_VISUAL_MONO01,
+			.xpanstep = 0,
+			.ypanstep = 1,
+			.ywrapstep = 0,
+			.line_length = GFB_MONO_LINE_LENGTH, /*   = xres * bpp/8  + 12 bytes padding */
+			.smem_len = 13760, /*   = xres * 8/8 * yres_virtual, room for 8 bpp gray   */
+			.accel = FB_ACCEL_NONE,
+		},
+		.var = {
+			.xres = GFB_MONO_XRES,
+			.yres = GFB_MONO_YRES,
+			.xres_virtual = GFB_MONO_XRES,
+			.yres_virtual = 2 * GFB_MONO_YRES, /* front and back buffer */
+			.bits_per_pixel = 1,
+		},
+		.vbitmap_size = 992, /*   = 32 + ceil(yres/8) * xres   */
+		.update_rate_limit = GFB_MONO_UPDATE_RATE_LIMIT,
+		.bulk = false,
+		.init_message = gfb_mono_init_message,
+		.pack = gfb_fb_mono_pack,
+		.check_format = gfb_mono_check_format,
+		.set_format = gfb_mono_set_format,
+	},
+	[GFB_PANEL_TYPE_320_240_16] = {
+		.fix = {
+			.id = "GFB_QVGA",
+			.type = FB_TYPE_PACKED_PIXELS,
+			.visual = FB_VISUAL_TRUECOLOR,
+			.xpanstep = 0,
+			.ypanstep = 1,
+			.ywrapstep = 0,
+			.line_length = 640, /*   = xres * bpp/8   */
+			.smem_len = 614400, /*   = xres * 32/8 * yres_virtual, room for XRGB8888   */
+			.accel = FB_ACCEL_NONE,
+		},
+		.var = {
+			.xres = GFB_QVGA_XRES,
+			.yres = GFB_QVGA_YRES,
+			.xres_virtual = GFB_QVGA_XRES,
+			.yres_virtual = 2 * GFB_QVGA_YRES, /* front and back buffer */
+			.bits_per_pixel = 16,
+			.red        = {11, 5, 0}, /* RGB565 */
+			.green      = { 5, 6, 0},
+			.blue       = { 0, 5, 0},
+			.transp     = { 0, 0, 0},
+		},
+		.vbitmap_size = 154112, /*   = yres * line_length + sizeof(hdata)   */
+		.update_rate_limit = GFB_QVGA_UPDATE_RATE_LIMIT,
+		.bulk = true,
+		.init_message = gfb_qvga_init_message,
+		.pack = gfb_fb_qvga_pack,
+		.check_format = gfb_qvga_check_format,
+		.set_format = gfb_qvga_set_format,
+	},
+};
 
-		data->fb_urb->actual_length = 0;
-
-		retval = usb_submit_urb(data->fb_urb, GFP_ATOMIC); /* atomic since we're holding a spinlock */
-		if (unlikely(retval < 0)) {
-			/*
-			 * We need to unlock the framebuffer urb lock since
-			 * the urb submission failed and therefore
-			 * g19_fb_urb_completion() won't be called.
-			 */
-			spin_unlock_irqrestore(&data->fb_urb_lock, irq_flags);
-			return retval;
-		}
+/*
+ * Frame pacing
+ *
+ * Damage is only collected as it comes in. The frame timer fires at most
+ * once per fb_frame_interval, and the update work it queues converts and
+ * sends everything collected so far in a single frame. The interval is
+ * kept in nanoseconds, so the rate doesn't depend on HZ.
+ *
+ * Damage is in the coordinates of the virtual screen, which holds two
+ * buffers on top of each other. Only what falls into the displayed one
+ * is converted; a NULL damage rectangle means all of it.
+ */
+static void gfb_fb_damage(struct gfb_data *data, const struct gfb_rect *damage)
+{
+	struct gfb_rect front;
+	unsigned long irq_flags;
 
-		/* All succeeded - mark the softlock and unlock the spinlock */
-		data->fb_vbitmap_busy = true;
-		spin_unlock_irqrestore(&data->fb_urb_lock, irq_flags);
-	} else {
-		spin_unlock_irqrestore(&data->fb_urb_lock, irq_flags); /* locked before if test */
-		schedule_delayed_work(&data->fb_info->deferred_work, data->fb_defio.delay);
+	spin_lock_irqsave(&data->fb_urb_lock, irq_flags);
+	if (damage == NULL) {
+		front.x1 = 0;
+		front.y1 = data->fb_yoffset;
+		front.x2 = data->fb_info->var.xres;
+		front.y2 = data->fb_yoffset + data->fb_info->var.yres;
+		damage = &front;
 	}
-
-	return retval;
+	gfb_rect_union(&data->fb_damage, damage);
+	gfb_fb_arm_frame(data);
+	spin_unlock_irqrestore(&data->fb_urb_lock, irq_flags);
 }
 
+/* Damage a width x height area at x, y, clipped to the virtual screen */
+static void gfb_fb_damage_area(struct gfb_data *data, u32 x, u32 y,
+                               u32 width, u32 height)
+{
+	u32 xres = data->fb_info->var.xres;
+	u32 yres = data->fb_info->var.yres_virtual;
+	struct gfb_rect damage;
 
-char hdata[512] = {
-	0x10, 0x0f, 0x00, 0x58, 0x02, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x3f, 0x01, 0xef, 0x00, 0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f, 0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x4b, 0x4c, 0x4d, 0x4e, 0x4f, 0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x5b, 0x5c, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x7b, 0x7c, 0x7d, 0x7e, 0x7f, 0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x8b, 0x8c, 0x8d, 0x8e, 0x8f, 0x90, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0x9b, 0x9c, 0x9d, 0x9e, 0x9f, 0xa0, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xab, 0xac, 0xad, 0xae, 0xaf, 0xb0, 0xb1, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xbb, 0xbc, 0xbd, 0xbe, 0xbf, 0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xcb, 0xcc, 0xcd, 0xce, 0xcf, 0xd0, 0xd1, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xdb, 0xdc, 0xdd, 0xde, 0xdf, 0xe0, 0xe1, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xeb, 0xec, 0xed, 0xee, 0xef, 0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff, 0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x1b, 0x1c, 0x1d, 0x1e, 0x1f, 0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2a, 0x2b, 0x2c, 0x2d, 0x2e, 0x2f, 0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x3b, 0x3c, 0x3d, 0x3e, 0x3f, 0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x4b, 0x4c, 0x4d, 0x4e, 0x4f, 0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5a, 0x5b, 0x5c, 0x5d, 0x5e, 0x5f, 0x60, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x6b, 0x6c, 0x6d, 0x6e, 0x6f, 0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x7b, 0x7c, 0x7d, 0x7e, 0x7f, 0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8a, 0x8b, 0x8c, 0x8d, 0x8e, 0x8f, 0x90, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0x9b, 0x9c, 0x9d, 0x9e, 0x9f, 0xa0, 0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xab, 0xac, 0xad, 0xae, 0xaf, 0xb0, 0xb1, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xbb, 0xbc, 0xbd, 0xbe, 0xbf, 0xc0, 0xc1, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9, 0xca, 0xcb, 0xcc, 0xcd, 0xce, 0xcf, 0xd0, 0xd1, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xdb, 0xdc, 0xdd, 0xde, 0xdf, 0xe0, 0xe1, 0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xeb, 0xec, 0xed, 0xee, 0xef, 0xf0, 0xf1, 0xf2, 0xf3, 0xf4, 0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa, 0xfb, 0xfc, 0xfd, 0xfe, 0xff
-};
+	if (x >= xres || y >= yres || width == 0 || height == 0)
+		return;
 
-/* Update fb_vbitmap from the screen_base and send to the device */
-static void gfb_fb_qvga_update(struct gfb_data *data)
-{
-	int xres, yres;
-	int col, row;
-	u16 *src, *dst;
+	damage.x1 = x;
+	damage.y1 = y;
+	damage.x2 = min(xres - x, width) + x;
+	damage.y2 = min(yres - y, height) + y;
 
-	/* Set the image message header */
-	memcpy(data->fb_vbitmap, &hdata, sizeof(hdata));
+	gfb_fb_damage(data, &damage);
+}
 
-	/* LCD is a portrait mode one so we have to rotate the framebuffer */
+static enum hrtimer_restart gfb_fb_frame_timer(struct hrtimer *timer)
+{
+	struct gfb_data *data = container_of(timer, struct gfb_data,
+	                                     fb_frame_timer);
 
-	src = (u16 *)data->fb_bitmap;
-	dst = (u16 *)(data->fb_vbitmap + sizeof(hdata));
+	schedule_work(&data->fb_update_work);
 
-	xres = data->fb_info->var.xres;
-	yres = data->fb_info->var.yres;
-	for (col = 0; col < xres; ++col)
-		for (row = 0; row < yres; ++row)
-			*dst++ = src[row * xres + col];
+	return HRTIMER_NORESTART;
 }
 
-static void gfb_fb_mono_update(struct gfb_data *data)
+static void gfb_fb_update_work(struct work_struct *work)
 {
-	int xres, yres, ll;
-	int band, bands, col, bit;
-	u8 *dst, *src, *row_start;
-	u8 mask;
-
-	/* Clear the vbitmap (we only flip bits to 1 later on) */
-	memset(data->fb_vbitmap, 0x00, data->fb_vbitmap_size);
+	struct gfb_data *data = container_of(work, struct gfb_data,
+	                                     fb_update_work);
+	struct gfb_rect damage;
+	unsigned long irq_flags;
+	u32 yoffset, yres = data->fb_info->var.yres;
 
-	/* Set the magic number */
-	data->fb_vbitmap[0] = 0x03;
+	spin_lock_irqsave(&data->fb_urb_lock, irq_flags);
+	damage = data->fb_damage;
+	yoffset = data->fb_yoffset;
+	gfb_rect_clear(&data->fb_damage);
+	data->fb_frame_due = ktime_add(ktime_get(), data->fb_frame_interval);
+	/* Damage from now on goes into the next frame */
+	data->fb_frame_armed = false;
+	spin_unlock_irqrestore(&data->fb_urb_lock, irq_flags);
 
-	/*
-	 * Translate the XBM format screen_base into the format needed by the
-	 * G15. This format places the pixels in a vertical rather than
-	 * horizontal format. Assuming a grid with 0,0 in the upper left corner
-	 * and 159,42 in the lower right corner, the first byte contains the
-	 * pixels 0,0 through 0,7 and the second byte contains the pixels 1,0
-	 * through 1,7. Within the byte, bit 0 represents 0,0; bit 1 0,1; etc.
-	 *
-	 * The offset is adjusted by 32 within the image message.
-	 */
+	/* Drawing into the back buffer shows up when it's flipped to */
+	damage.y1 = max_t(int, damage.y1, yoffset) - yoffset;
+	damage.y2 = min_t(int, damage.y2, yoffset + yres) - yoffset;
 
-	xres = data->fb_info->var.xres;
-	yres = data->fb_info->var.yres;
-	ll = data->fb_info->fix.line_length;
-	
-	dst = data->fb_vbitmap + 32;
-
-	bands = (yres + 7) / 8; /* poor man's ceil(yres/8) */
-	for (band = 0; band < bands ; ++band) {
-		/* each band is 8 pixels vertically */
-		row_start = data->fb_bitmap + band * 8 * ll;
-		for (col = 0; col < xres; ++col) {
-			src = row_start + col / 8;
-			mask = 0x01 << (col % 8);
-			for (bit = 0 ; bit < 8 ; ++bit) {
-				if (*src & mask) 
-					*dst |= (0x01 << bit);
-				src += ll;
-			}
-			++dst;
-		}
+	if (!gfb_rect_empty(&damage)) {
+		gfb_fb_update(data, data->fb_bitmap + yoffset * data->fb_info->fix.line_length,
+		              &damage);
+		return;
 	}
-}
 
-static int gfb_fb_update(struct gfb_data *data)
-{
-	int result = 0;
-	switch (data->panel_type) {
-	case GFB_PANEL_TYPE_160_43_1:
-		gfb_fb_mono_update(data);
-		result = gfb_fb_send(data);
-		break;
-	case GFB_PANEL_TYPE_320_240_16:
-		gfb_fb_qvga_update(data);
-		result = gfb_fb_send(data);
-		break;
-	default:
-		break;
-	}
-	return result;
+	/* Only a window left over from a failed message to send again */
+	mutex_lock(&data->fb_vbitmap_lock);
+	gfb_fb_send(data);
+	mutex_unlock(&data->fb_vbitmap_lock);
 }
 
-/* Callback from deferred IO workqueue */
+/*
+ * Callback from deferred IO workqueue
+ *
+ * The page list only holds the pages written to since the last callback.
+ * Turn it into the band of rows they cover so the update can skip the
+ * untouched part of the screen.
+ */
 static void gfb_fb_deferred_io(struct fb_info *info, struct list_head *pagelist)
 {
-	gfb_fb_update(info->par);
+	struct gfb_data *data = info->par;
+	struct gfb_rect damage;
+	struct page *page;
+	unsigned long first = ULONG_MAX;
+	unsigned long last = 0;
+	u32 ll = info->fix.line_length;
+
+	list_for_each_entry(page, pagelist, lru) {
+		if (page->index < first)
+			first = page->index;
+		if (page->index > last)
+			last = page->index;
+	}
+
+	if (first > last)
+		return;
+
+	damage.x1 = 0;
+	damage.x2 = info->var.xres;
+	damage.y1 = (first << PAGE_SHIFT) / ll;
+	damage.y2 = min_t(unsigned long, info->var.yres_virtual,
+	                  DIV_ROUND_UP((last + 1) << PAGE_SHIFT, ll));
+
+	if (damage.y1 >= damage.y2)
+		return;
+
+	gfb_fb_damage(data, &damage);
 }
 
 
@@ -304,30 +1235,30 @@ static int gfb_fb_setcolreg(unsigned regno, unsigned red, unsigned green,
 	return 0;
 }
 
-/* Stub to call the system default and update the image on the gfb */
+/* Stub to call the system default and queue the area for the gfb */
 static void gfb_fb_fillrect(struct fb_info *info,
                             const struct fb_fillrect *rect)
 {
 	struct gfb_data *par = info->par;
 	sys_fillrect(info, rect);
-	gfb_fb_update(par);
+	gfb_fb_damage_area(par, rect->dx, rect->dy, rect->width, rect->height);
 }
 
-/* Stub to call the system default and update the image on the gfb */
+/* Stub to call the system default and queue the area for the gfb */
 static void gfb_fb_copyarea(struct fb_info *info,
                             const struct fb_copyarea *area)
 {
 	struct gfb_data *par = info->par;
 	sys_copyarea(info, area);
-	gfb_fb_update(par);
+	gfb_fb_damage_area(par, area->dx, area->dy, area->width, area->height);
 }
 
-/* Stub to call the system default and update the image on the gfb */
+/* Stub to call the system default and queue the area for the gfb */
 static void gfb_fb_imageblit(struct fb_info *info, const struct fb_image *image)
 {
 	struct gfb_data *par = info->par;
 	sys_imageblit(info, image);
-	gfb_fb_update(par);
+	gfb_fb_damage_area(par, image->dx, image->dy, image->width, image->height);
 }
 
 
@@ -363,19 +1294,225 @@ static int gfb_fb_release(struct fb_info *info, int user)
 	return 0;
 }
 
+/*
+ * Only the layout of the screen can change. var.nonstd is 0 for the
+ * usual fbdev layout or GFB_NONSTD_NATIVE for the device one. In the
+ * usual layout the G19 also takes XRGB8888 at 32 bpp and the G13/G15
+ * 8 bpp grayscale. The screen size stays the same.
+ */
+static int gfb_fb_check_var(struct fb_var_screeninfo *var,
+                            struct fb_info *info)
+{
+	struct gfb_data *data = info->par;
+
+	if (var->nonstd != 0 && var->nonstd != GFB_NONSTD_NATIVE)
+		return -EINVAL;
+
+	if (var->xres != info->var.xres ||
+	    var->yres != info->var.yres ||
+	    var->xres_virtual != info->var.xres_virtual ||
+	    var->yres_virtual != info->var.yres_virtual)
+		return -EINVAL;
+
+	if (data->fb_panel->check_format(var))
+		return -EINVAL;
+
+	if (var->xoffset != 0 ||
+	    var->yoffset + var->yres > var->yres_virtual)
+		return -EINVAL;
+
+	return 0;
+}
+
+static int gfb_fb_set_par(struct fb_info *info)
+{
+	struct gfb_data *data = info->par;
+
+	data->fb_native = info->var.nonstd == GFB_NONSTD_NATIVE;
+	data->fb_panel->set_format(data);
+
+	/* the same bytes mean something else now, compare all of them */
+	gfb_fb_damage(data, NULL);
+
+	return 0;
+}
+
+/*
+ * Flip to the other buffer, or anywhere in between. The whole new front
+ * buffer is converted with the next frame; only what differs from the
+ * panel content is sent.
+ */
+static int gfb_fb_pan_display(struct fb_var_screeninfo *var,
+                              struct fb_info *info)
+{
+	struct gfb_data *data = info->par;
+	unsigned long irq_flags;
+
+	if (var->xoffset != 0 ||
+	    var->yoffset + info->var.yres > info->var.yres_virtual)
+		return -EINVAL;
+
+	spin_lock_irqsave(&data->fb_urb_lock, irq_flags);
+	data->fb_yoffset = var->yoffset;
+	spin_unlock_irqrestore(&data->fb_urb_lock, irq_flags);
+
+	gfb_fb_damage(data, NULL);
+
+	return 0;
+}
+
+/*
+ * Is a frame on its way to the panel? A pending frame slot or send
+ * will end in a completion or an unchanged send, both of which count
+ * as a frame. fb_urb_lock held
+ */
+static bool gfb_fb_busy(struct gfb_data *data)
+{
+	return data->fb_frame_armed || data->fb_send_pending ||
+	       gfb_fb_in_flight(data);
+}
+
+/*
+ * Wait until the next frame reached the panel, or return right away if
+ * there is none on its way. Renderers use this to draw at the rate the
+ * device really takes frames.
+ */
+static int gfb_fb_wait_for_frame(struct gfb_data *data)
+{
+	unsigned long irq_flags;
+	unsigned long seq;
+	long ret;
+
+	spin_lock_irqsave(&data->fb_urb_lock, irq_flags);
+	if (!gfb_fb_busy(data)) {
+		spin_unlock_irqrestore(&data->fb_urb_lock, irq_flags);
+		return 0;
+	}
+	seq = data->fb_frame_seq;
+	spin_unlock_irqrestore(&data->fb_urb_lock, irq_flags);
+
+	ret = wait_event_interruptible_timeout(data->fb_frame_wait,
+	                                       data->fb_frame_seq != seq ||
+	                                       data->virtualized,
+	                                       GFB_FRAME_WAIT_TIMEOUT);
+	if (ret < 0)
+		return ret;
+	if (ret == 0)
+		return -ETIMEDOUT;
+	if (data->virtualized)
+		return -ENODEV;
+
+	return 0;
+}
+
+/* Queue the areas drawn by a client in manual update mode */
+static int gfb_fb_flush(struct gfb_data *data,
+                        const struct gfb_flush __user *uflush)
+{
+	struct gfb_flush flush;
+	unsigned i;
+
+	if (copy_from_user(&flush, uflush, sizeof(flush)))
+		return -EFAULT;
+
+	if (flush.count > GFB_FLUSH_MAX_RECTS)
+		return -EINVAL;
+
+	for (i = 0; i < flush.count; i++)
+		gfb_fb_damage_area(data, flush.rects[i].x, flush.rects[i].y,
+		                   flush.rects[i].width, flush.rects[i].height);
+
+	return 0;
+}
+
+static int gfb_fb_ioctl(struct fb_info *info, unsigned int cmd,
+                        unsigned long arg)
+{
+	struct gfb_data *data = info->par;
+	u32 crtc, mode;
+
+	switch (cmd) {
+	case GFBIO_GET_UPDATE_MODE:
+		return put_user(data->fb_update_mode, (u32 __user *)arg);
+	case GFBIO_SET_UPDATE_MODE:
+		if (get_user(mode, (u32 __user *)arg))
+			return -EFAULT;
+		if (mode != GFB_UPDATE_DEFERRED && mode != GFB_UPDATE_MANUAL)
+			return -EINVAL;
+		data->fb_update_mode = mode;
+		return 0;
+	case GFBIO_FLUSH:
+		return gfb_fb_flush(data, (const struct gfb_flush __user *)arg);
+	case FBIO_WAITFORVSYNC:
+		if (get_user(crtc, (u32 __user *)arg))
+			return -EFAULT;
+		/* there is a single panel */
+		if (crtc != 0)
+			return -ENODEV;
+		return gfb_fb_wait_for_frame(data);
+	}
+
+	return -ENOTTY;
+}
+
+/* fb_mmap of deferred IO, which write protects the mapping */
+static int (*gfb_defio_mmap)(struct fb_info *info, struct vm_area_struct *vma);
+
+/*
+ * In manual update mode the client tells which areas it drew, so the
+ * mapping goes straight to the framebuffer memory without the page
+ * faults deferred IO takes to track writes.
+ */
+static int gfb_fb_mmap(struct fb_info *info, struct vm_area_struct *vma)
+{
+	struct gfb_data *data = info->par;
+
+	if (data->fb_update_mode == GFB_UPDATE_MANUAL)
+		return remap_vmalloc_range(vma, data->fb_bitmap, vma->vm_pgoff);
+
+	return gfb_defio_mmap(info, vma);
+}
+
 /*
  * this is the slow path from userspace. they can seek and write to
- * the fb. it's inefficient to do anything less than a full screen draw
+ * the fb. only the rows written are queued for the next frame, or the
+ * pixels written if they are all on one row.
  */
 static ssize_t gfb_fb_write(struct fb_info *info, const char __user *buf,
                             size_t count, loff_t *ppos)
 {
 	struct gfb_data *par = info->par;
+	u32 ll = info->fix.line_length;
+	u32 bpp = info->var.bits_per_pixel;
+	unsigned long total = info->screen_size ? info->screen_size : info->fix.smem_len;
+	unsigned long start = *ppos;
+	unsigned long last;
+	u32 y1, y2, x1, x2;
 	ssize_t result;
 
 	result = fb_sys_write(info, buf, count, ppos);
-	if (result != -EFAULT && result != -EPERM)
-		result = gfb_fb_update(par);
+
+	/*
+	 * fb_sys_write() can copy part of buf and still fail, -ENOSPC for
+	 * a write running past the end, so queue whatever it may have
+	 * touched rather than trusting result.
+	 */
+	if (start >= total || count == 0)
+		return result;
+
+	last = start + min_t(unsigned long, count, total - start) - 1;
+	y1 = start / ll;
+	y2 = last / ll + 1;
+	if (y2 - y1 == 1) {
+		x1 = (start % ll) * 8 / bpp;
+		x2 = DIV_ROUND_UP((last % ll + 1) * 8, bpp);
+	} else {
+		x1 = 0;
+		x2 = info->var.xres;
+	}
+
+	gfb_fb_damage_area(par, x1, y1, x2 - x1, y2 - y1);
+
 	return result;
 }
 
@@ -389,6 +1526,10 @@ static struct fb_ops gfb_ops = {
 	.fb_fillrect  = gfb_fb_fillrect,
 	.fb_copyarea  = gfb_fb_copyarea,
 	.fb_imageblit = gfb_fb_imageblit,
+	.fb_ioctl     = gfb_fb_ioctl,
+	.fb_pan_display = gfb_fb_pan_display,
+	.fb_check_var = gfb_fb_check_var,
+	.fb_set_par   = gfb_fb_set_par,
 };
 
 /*
@@ -432,14 +1573,24 @@ EXPORT_SYMBOL_GPL(gfb_fb_update_rate_show);
 static ssize_t gfb_set_fb_update_rate(struct gfb_data *data,
                                       unsigned fb_update_rate)
 {
-	if (fb_update_rate > GFB_UPDATE_RATE_LIMIT)
-		data->fb_update_rate = GFB_UPDATE_RATE_LIMIT;
+	unsigned limit = data->fb_panel->update_rate_limit;
+	unsigned long irq_flags;
+
+	if (fb_update_rate > limit)
+		fb_update_rate = limit;
 	else if (fb_update_rate == 0)
-		data->fb_update_rate = 1;
-	else
-		data->fb_update_rate = fb_update_rate;
+		fb_update_rate = 1;
 
-	data->fb_defio.delay = HZ / data->fb_update_rate;
+	spin_lock_irqsave(&data->fb_urb_lock, irq_flags);
+	data->fb_update_rate = fb_update_rate;
+	data->fb_frame_interval = ktime_set(0, NSEC_PER_SEC / fb_update_rate);
+	spin_unlock_irqrestore(&data->fb_urb_lock, irq_flags);
+
+	/*
+	 * Deferred IO only collects the damage, the frame timer paces the
+	 * updates. Collect at least as often as frames go out.
+	 */
+	data->fb_defio.delay = max_t(unsigned long, 1, HZ / fb_update_rate);
 
 	return 0;
 }
@@ -477,15 +1628,127 @@ static struct fb_deferred_io gfb_fb_defio = {
 };
 
 
+/*
+ * The debugfs counters
+ *
+ * Every device gets a directory under gfb/ in debugfs, named after the
+ * HID device. The plain counters are read as they are, the tables are
+ * copied under fb_urb_lock first.
+ */
+static int gfb_debugfs_urb_errors_show(struct seq_file *m, void *v)
+{
+	struct gfb_data *data = m->private;
+	u64 urb_errors[GFB_STATS_ERRNO_MAX];
+	unsigned long irq_flags;
+	int i;
+
+	spin_lock_irqsave(&data->fb_urb_lock, irq_flags);
+	memcpy(urb_errors, data->fb_stats.urb_errors, sizeof(urb_errors));
+	spin_unlock_irqrestore(&data->fb_urb_lock, irq_flags);
+
+	for (i = 1; i < GFB_STATS_ERRNO_MAX; i++)
+		if (urb_errors[i])
+			seq_printf(m, "%d %llu\n", -i, urb_errors[i]);
+	if (urb_errors[0])
+		seq_printf(m, "other %llu\n", urb_errors[0]);
+
+	return 0;
+}
+
+static void gfb_debugfs_hist_show(struct seq_file *m, const u64 *hist)
+{
+	u64 copy[GFB_STATS_HIST_SIZE];
+	struct gfb_data *data = m->private;
+	unsigned long irq_flags;
+	int i;
+
+	spin_lock_irqsave(&data->fb_urb_lock, irq_flags);
+	memcpy(copy, hist, sizeof(copy));
+	spin_unlock_irqrestore(&data->fb_urb_lock, irq_flags);
+
+	/* bucket i holds [2^i, 2^(i+1)) us, the first one also holds 0 */
+	for (i = 0; i < GFB_STATS_HIST_SIZE - 1; i++)
+		seq_printf(m, "%lu-%lu us %llu\n", i ? 1UL << i : 0UL,
+		           (1UL << (i + 1)) - 1, copy[i]);
+	seq_printf(m, "%lu- us %llu\n", 1UL << i, copy[i]);
+}
+
+static int gfb_debugfs_convert_show(struct seq_file *m, void *v)
+{
+	struct gfb_data *data = m->private;
+
+	gfb_debugfs_hist_show(m, data->fb_stats.convert_hist);
+	return 0;
+}
+
+static int gfb_debugfs_latency_show(struct seq_file *m, void *v)
+{
+	struct gfb_data *data = m->private;
+
+	gfb_debugfs_hist_show(m, data->fb_stats.latency_hist);
+	return 0;
+}
+
+#define GFB_DEBUGFS_FOPS(name)                                          \
+	static int gfb_debugfs_##name##_open(struct inode *inode,       \
+	                                     struct file *file)         \
+	{                                                               \
+		return single_open(file, gfb_debugfs_##name##_show,     \
+		                   inode->i_private);                   \
+	}                                                               \
+	static const struct file_operations gfb_debugfs_##name##_fops = { \
+		.owner = THIS_MODULE,                                   \
+		.open = gfb_debugfs_##name##_open,                      \
+		.read = seq_read,                                       \
+		.llseek = seq_lseek,                                    \
+		.release = single_release,                              \
+	}
+
+GFB_DEBUGFS_FOPS(urb_errors);
+GFB_DEBUGFS_FOPS(convert);
+GFB_DEBUGFS_FOPS(latency);
+
+static void gfb_debugfs_init(struct gfb_data *data, struct hid_device *hdev)
+{
+	struct dentry *dir;
+
+	if (IS_ERR_OR_NULL(gfb_debugfs_root))
+		return;
+
+	dir = debugfs_create_dir(dev_name(&hdev->dev), gfb_debugfs_root);
+	if (IS_ERR_OR_NULL(dir))
+		return;
+
+	debugfs_create_u64("converted", 0444, dir, &data->fb_stats.converted);
+	debugfs_create_u64("submitted", 0444, dir, &data->fb_stats.submitted);
+	debugfs_create_u64("completed", 0444, dir, &data->fb_stats.completed);
+	debugfs_create_u64("busy", 0444, dir, &data->fb_stats.busy);
+	debugfs_create_u64("unchanged", 0444, dir, &data->fb_stats.unchanged);
+	debugfs_create_u64("submit_errors", 0444, dir, &data->fb_stats.submit_errors);
+	debugfs_create_file("urb_errors", 0444, dir, data, &gfb_debugfs_urb_errors_fops);
+	debugfs_create_file("convert_us", 0444, dir, data, &gfb_debugfs_convert_fops);
+	debugfs_create_file("latency_us", 0444, dir, data, &gfb_debugfs_latency_fops);
+
+	data->debugfs_dir = dir;
+}
+
+
 /* Free the gfb_data structure and the bitmaps. */
 static void gfb_free_data(struct kref *kref)
 {
 	struct gfb_data *data = container_of(kref, struct gfb_data, kref);
+	int i;
 
 	if (data->fb_bitmap)
 		vfree(data->fb_bitmap);
 	if (data->fb_vbitmap)
 		kfree(data->fb_vbitmap);
+	for (i = 0; i < GFB_FRAME_RING; i++)
+		if (data->fb_frames[i].buf)
+			usb_free_coherent(data->usb_dev, data->fb_vbitmap_size,
+			                  data->fb_frames[i].buf,
+			                  data->fb_frames[i].dma);
+	usb_put_dev(data->usb_dev);
 
 	kfree(data);
 }
@@ -497,11 +1760,23 @@ static void gfb_free_framebuffer_work(struct work_struct *work)
 	struct gfb_data *data = container_of(work, struct gfb_data,
 	                                     free_framebuffer_work.work);
 	struct fb_info *info = data->fb_info;
+	int i;
+
+	debugfs_remove_recursive(data->debugfs_dir);
+	data->debugfs_dir = NULL;
 
 	if (info) {
 		fb_deferred_io_cleanup(info);
 		unregister_framebuffer(info);
-		usb_free_urb(data->fb_urb);
+		/* no more damage can come in, stop the pending frame */
+		hrtimer_cancel(&data->fb_frame_timer);
+		cancel_work_sync(&data->fb_update_work);
+		for (i = 0; i < GFB_FRAME_RING; i++)
+			usb_kill_urb(data->fb_frames[i].urb);
+		/* the completions above may have queued a send */
+		cancel_work_sync(&data->fb_send_work);
+		for (i = 0; i < GFB_FRAME_RING; i++)
+			usb_free_urb(data->fb_frames[i].urb);
 		framebuffer_release(info);
 
 		data->fb_info = NULL;
@@ -516,7 +1791,12 @@ static void gfb_free_framebuffer_work(struct work_struct *work)
 struct gfb_data *gfb_probe(struct hid_device *hdev,
                            const int panel_type) {
 	int error;
+	int i;
 	struct gfb_data *data;
+	struct gfb_frame *frame;
+	struct usb_interface *intf;
+	struct usb_host_endpoint *ep;
+	unsigned int pipe;
 
 	dev_dbg(&hdev->dev, "Logitech GamePanel framebuffer probe...");
 
@@ -544,102 +1824,141 @@ struct gfb_data *gfb_probe(struct hid_device *hdev,
 
 	/* init Framebuffer visual structures */
 
-	data->panel_type = panel_type;
-
-	switch (panel_type) {
-	case GFB_PANEL_TYPE_160_43_1:
-		data->fb_info->fix = (struct fb_fix_screeninfo) {
- 			.id = "GFB_MONO",
-			.type = FB_TYPE_PACKED_PIXELS,
-			.visual = FB_VISUAL_MONO01,
-			.xpanstep = 0,
-			.ypanstep = 0,
-			.ywrapstep = 0,
-			.line_length = 32, /*   = xres * bpp/8  + 12 bytes padding */
-			.accel = FB_ACCEL_NONE,
-		};
-		data->fb_info->var = (struct fb_var_screeninfo) {
-			.xres = 160,
-			.yres = 43,
-			.xres_virtual = 160,
-			.yres_virtual = 43,
-			.bits_per_pixel = 1,
-		};
-		data->fb_vbitmap_size = 992; /*   = 32 + ceil(yres/8) * xres   */
-		break;
-	case GFB_PANEL_TYPE_320_240_16:
-		data->fb_info->fix = (struct fb_fix_screeninfo) {
-			.id = "GFB_QVGA",
-			.type = FB_TYPE_PACKED_PIXELS,
-			.visual = FB_VISUAL_TRUECOLOR,
-			.xpanstep = 0,
-			.ypanstep = 0,
-			.ywrapstep = 0,
-			.line_length = 640, /*   = xres * bpp/8   */
-			.accel = FB_ACCEL_NONE,
-		};
-		data->fb_info->var = (struct fb_var_screeninfo) {
-			.xres = 320,
-			.yres = 240,
-			.xres_virtual = 320,
-			.yres_virtual = 240,
-			.bits_per_pixel = 16,
-			.red        = {11, 5, 0}, /* RGB565 */
-			.green      = { 5, 6, 0},
-			.blue       = { 0, 5, 0},
-			.transp     = { 0, 0, 0},
-		};
-		data->fb_vbitmap_size = 154112; /*   = yres * line_length + sizeof(hdata)   */
-		break;
-	default:
+	if (panel_type < 0 || panel_type >= ARRAY_SIZE(gfb_panels)) {
 		dev_err(&hdev->dev, GFB_NAME ": ERROR: unknown panel type\n");
 		goto err_cleanup_fb;
 	}
+
+	data->panel_type = panel_type;
+	data->fb_panel = &gfb_panels[panel_type];
+	data->fb_info->fix = data->fb_panel->fix;
+	data->fb_info->var = data->fb_panel->var;
+	data->fb_vbitmap_size = data->fb_panel->vbitmap_size;
+
 	data->fb_info->pseudo_palette = &pseudo_palette;
 	data->fb_info->fbops = &gfb_ops;
-	data->fb_info->fix.smem_len = data->fb_info->fix.line_length * data->fb_info->var.yres;
 	data->fb_info->par = data;
 	data->fb_info->flags = FBINFO_FLAG_DEFAULT;
+	data->fb_panel->set_format(data);
 
 	data->hdev = hdev;
 
-	data->fb_bitmap = vmalloc(data->fb_info->fix.smem_len);
+	/*
+	 * Both bitmaps start out blank: partial updates only convert the
+	 * damaged area, so the rest of fb_vbitmap must match fb_bitmap.
+	 * fb_bitmap also has to be mappable as a whole for the manual
+	 * update mode.
+	 */
+	data->fb_bitmap = vmalloc_user(data->fb_info->fix.smem_len);
 	if (data->fb_bitmap == NULL) {
 		dev_err(&hdev->dev, GFB_NAME ": ERROR: can't get a free page for framebuffer\n");
 		error = -ENOMEM;
 		goto err_cleanup_data;
 	}
 
-	data->fb_vbitmap = kmalloc(sizeof(u8) * data->fb_vbitmap_size, GFP_KERNEL);
+	data->fb_vbitmap = kzalloc(sizeof(u8) * data->fb_vbitmap_size, GFP_KERNEL);
 	if (data->fb_vbitmap == NULL) {
 		dev_err(&hdev->dev, GFB_NAME ": ERROR: can't alloc vbitmap image buffer\n");
 		error = -ENOMEM;
 		goto err_cleanup_fb_bitmap;
 	}
-	data->fb_vbitmap_busy = false;
+
+	/* The panel content is unknown, the first message redraws all of it */
+	data->fb_window = (struct gfb_rect) {
+		.x1 = 0,
+		.y1 = 0,
+		.x2 = data->fb_info->var.xres,
+		.y2 = data->fb_info->var.yres,
+	};
 
 	spin_lock_init(&data->fb_urb_lock);
+	mutex_init(&data->fb_vbitmap_lock);
 
-	data->fb_urb = usb_alloc_urb(0, GFP_KERNEL);
-	if (data->fb_urb == NULL) {
-		dev_err(&hdev->dev, GFB_NAME ": ERROR: can't alloc usb urb\n");
-		error = -ENOMEM;
+	/*
+	 * Every message goes to the same endpoint, so resolve it once and
+	 * fill in the urbs of the ring for good. The message buffers are
+	 * DMA-coherent and keep their header between messages.
+	 */
+	intf = to_usb_interface(hdev->dev.parent);
+	data->usb_dev = usb_get_dev(interface_to_usbdev(intf));
+
+	if (data->fb_panel->bulk)
+		pipe = usb_sndbulkpipe(data->usb_dev, 0x02);
+	else
+		pipe = usb_sndintpipe(data->usb_dev, 0x02);
+
+	ep = (usb_pipein(pipe) ? data->usb_dev->ep_in : data->usb_dev->ep_out)[usb_pipeendpoint(pipe)];
+	if (ep == NULL) {
+		dev_err(&hdev->dev, GFB_NAME ": ERROR: no framebuffer endpoint\n");
+		error = -ENODEV;
 		goto err_cleanup_fb_vbitmap;
 	}
 
-	data->fb_info->screen_base = (char __force __iomem *) data->fb_bitmap;
+	for (i = 0; i < GFB_FRAME_RING; i++) {
+		frame = &data->fb_frames[i];
+		frame->data = data;
+		frame->busy = false;
+
+		frame->buf = usb_alloc_coherent(data->usb_dev, data->fb_vbitmap_size,
+		                                GFP_KERNEL, &frame->dma);
+		if (frame->buf == NULL) {
+			dev_err(&hdev->dev, GFB_NAME ": ERROR: can't alloc image message buffer\n");
+			error = -ENOMEM;
+			goto err_cleanup_frames;
+		}
+
+		frame->urb = usb_alloc_urb(0, GFP_KERNEL);
+		if (frame->urb == NULL) {
+			dev_err(&hdev->dev, GFB_NAME ": ERROR: can't alloc usb urb\n");
+			error = -ENOMEM;
+			goto err_cleanup_frames;
+		}
+
+		data->fb_panel->init_message(frame->buf);
+		if (data->fb_panel->bulk)
+			usb_fill_bulk_urb(frame->urb, data->usb_dev, pipe, frame->buf, data->fb_vbitmap_size,
+			                  gfb_fb_urb_completion, frame);
+		else
+			usb_fill_int_urb(frame->urb, data->usb_dev, pipe, frame->buf, data->fb_vbitmap_size,
+			                 gfb_fb_urb_completion, frame, ep->desc.bInterval);
+		frame->urb->transfer_dma = frame->dma;
+		frame->urb->transfer_flags |= URB_NO_TRANSFER_DMA_MAP;
+	}
+	data->fb_frame_next = 0;
+	data->fb_send_pending = false;
+	data->fb_frame_seq = 0;
+	init_waitqueue_head(&data->fb_frame_wait);
+	INIT_WORK(&data->fb_send_work, gfb_fb_send_work);
 
-	data->fb_update_rate = GFB_UPDATE_RATE_DEFAULT;
+	data->fb_info->screen_base = (char __force __iomem *) data->fb_bitmap;
 
 	dbg_hid(KERN_INFO GFB_NAME " allocated framebuffer\n");
 
+	gfb_rect_clear(&data->fb_damage);
+	data->fb_frame_armed = false;
+	data->fb_frame_due = ktime_set(0, 0);
+	hrtimer_init(&data->fb_frame_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	data->fb_frame_timer.function = gfb_fb_frame_timer;
+	INIT_WORK(&data->fb_update_work, gfb_fb_update_work);
+
 	data->fb_defio = gfb_fb_defio;
 	data->fb_info->fbdefio = &data->fb_defio;
+	gfb_set_fb_update_rate(data, GFB_UPDATE_RATE_DEFAULT);
 
 	dbg_hid(KERN_INFO GFB_NAME " allocated deferred IO structure\n");
 
 	fb_deferred_io_init(data->fb_info);
 
+	/*
+	 * Deferred IO has just set its own fb_mmap, keep it for the
+	 * deferred update mode and pick the mode on every mmap
+	 */
+	if (data->fb_info->fbops->fb_mmap != gfb_fb_mmap) {
+		gfb_defio_mmap = data->fb_info->fbops->fb_mmap;
+		data->fb_info->fbops->fb_mmap = gfb_fb_mmap;
+	}
+	data->fb_update_mode = GFB_UPDATE_DEFERRED;
+
 	INIT_DELAYED_WORK(&data->free_framebuffer_work,
 	                  gfb_free_framebuffer_work);
 
@@ -649,6 +1968,8 @@ struct gfb_data *gfb_probe(struct hid_device *hdev,
 	data->fb_count = 0;
 	data->virtualized = false;
 
+	gfb_debugfs_init(data, hdev);
+
 	kref_get(&data->kref); /* matching kref_put in free_framebuffer_work */
 
 	return data;
@@ -656,7 +1977,10 @@ struct gfb_data *gfb_probe(struct hid_device *hdev,
 
 err_cleanup_fb_deferred:
 	fb_deferred_io_cleanup(data->fb_info);
-	usb_free_urb(data->fb_urb);
+
+err_cleanup_frames:
+	for (i = 0; i < GFB_FRAME_RING; i++)
+		usb_free_urb(data->fb_frames[i].urb);
 
 err_cleanup_fb_vbitmap:
 err_cleanup_fb_bitmap:
@@ -677,6 +2001,7 @@ EXPORT_SYMBOL_GPL(gfb_probe);
 void gfb_remove(struct gfb_data *data)
 {
 	data->virtualized = true;
+	wake_up_interruptible_all(&data->fb_frame_wait);
 	if (data->fb_count == 0)
 		schedule_delayed_work(&data->free_framebuffer_work, 0);
 
@@ -686,6 +2011,20 @@ void gfb_remove(struct gfb_data *data)
 EXPORT_SYMBOL_GPL(gfb_remove);
 
 
+static int __init gfb_init(void)
+{
+	gfb_debugfs_root = debugfs_create_dir("gfb", NULL);
+	return 0;
+}
+
+static void __exit gfb_exit(void)
+{
+	debugfs_remove_recursive(gfb_debugfs_root);
+}
+
+module_init(gfb_init);
+module_exit(gfb_exit);
+
 MODULE_DESCRIPTION("Logitech GFB HID Driver");
 MODULE_AUTHOR("Rick L Vinyard Jr (rvinyard@cs.nmsu.edu)");
 MODULE_AUTHOR("Alistair Buxton (a.j.buxton@gmail.com)");
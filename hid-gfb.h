@@ -5,6 +5,50 @@
 #define GFB_PANEL_TYPE_320_240_16	1
 
 #include <linux/fb.h>
+#include <linux/hrtimer.h>
+#include <linux/mutex.h>
+#include <linux/wait.h>
+
+/* Screen area, in pixels; x2 and y2 are exclusive */
+struct gfb_rect {
+	int x1, y1;
+	int x2, y2;
+};
+
+/* Number of image messages that can be in flight at once */
+#define GFB_FRAME_RING		3
+
+struct gfb_data;
+struct gfb_panel;
+
+/* Buckets of the log2 histograms, in microseconds */
+#define GFB_STATS_HIST_SIZE	20
+/* URB errors are counted by -status below this, the rest in slot 0 */
+#define GFB_STATS_ERRNO_MAX	128
+
+/* Framebuffer counters, shown in debugfs; protected by fb_urb_lock */
+struct gfb_stats {
+	u64 converted;          /* updates converted into fb_vbitmap */
+	u64 submitted;          /* messages handed to usb_submit_urb() */
+	u64 completed;          /* messages completed, with or without error */
+	u64 busy;               /* sends put off since the whole ring was in flight */
+	u64 unchanged;          /* sends skipped since nothing changed */
+	u64 submit_errors;      /* of which usb_submit_urb() failed */
+	u64 urb_errors[GFB_STATS_ERRNO_MAX];
+	u64 convert_hist[GFB_STATS_HIST_SIZE];  /* conversion time */
+	u64 latency_hist[GFB_STATS_HIST_SIZE];  /* submit to completion */
+};
+
+/* An image message and the urb sending it */
+struct gfb_frame {
+	struct gfb_data *data;
+	struct urb *urb;
+	u8 *buf;                /* message, up to fb_vbitmap_size bytes */
+	dma_addr_t dma;         /* DMA address of buf */
+	struct gfb_rect window; /* screen area carried by the message */
+	ktime_t submitted;      /* when the urb was submitted */
+	bool busy;              /* in flight; protected by fb_urb_lock */
+};
 
 /* Per device data structure */
 struct gfb_data {
@@ -13,22 +57,47 @@ struct gfb_data {
 
 	/* Framebuffer stuff */
 	int panel_type;         /* GFB_PANEL_TYPE_160_43_1 or GFB_PANEL_TYPE_320_240_16 */
+	const struct gfb_panel *fb_panel;
 
 	struct fb_info *fb_info;
 
 	struct fb_deferred_io fb_defio;
 	u8 fb_update_rate;
+	u32 fb_update_mode;     /* GFB_UPDATE_*, for mappings made from now on */
+	u32 fb_yoffset;         /* first row of the displayed buffer; protected by fb_urb_lock */
+	bool fb_native;         /* the screen is in the device layout, see GFB_NONSTD_NATIVE */
+	/* converts damage of the screen into fb_vbitmap, set with the format */
+	void (*fb_convert)(struct gfb_data *data, const u8 *screen,
+	                   const struct gfb_rect *damage,
+	                   struct gfb_rect *changed);
+
+	/* Frame pacing; protected by fb_urb_lock */
+	struct gfb_rect fb_damage;  /* screen area written, not converted yet */
+	ktime_t fb_frame_interval;  /* 1 / fb_update_rate */
+	ktime_t fb_frame_due;       /* earliest start of the next frame */
+	bool fb_frame_armed;        /* fb_frame_timer or fb_update_work pending */
+	struct hrtimer fb_frame_timer;
+	struct work_struct fb_update_work; /* converts and sends fb_damage */
 
 	u8 *fb_bitmap;          /* device-dependent bitmap */
-	u8 *fb_vbitmap;         /* userspace bitmap */
-	int fb_vbitmap_busy;    /* soft-lock for vbitmap; protected by fb_urb_lock */
+	u8 *fb_vbitmap;         /* userspace bitmap; protected by fb_vbitmap_lock */
+	struct mutex fb_vbitmap_lock; /* held across converting into and packing from fb_vbitmap */
 	size_t fb_vbitmap_size; /* size of vbitmap */
+	struct gfb_rect fb_window; /* changed area not sent yet; protected by fb_urb_lock */
 
 	struct delayed_work free_framebuffer_work;
 
 	/* USB stuff */
-	struct urb *fb_urb;
+	struct usb_device *usb_dev; /* referenced until the data is freed */
+	struct gfb_frame fb_frames[GFB_FRAME_RING];
+	int fb_frame_next;      /* where to look for a free frame first */
+	bool fb_send_pending;   /* fb_window waits for a free frame; protected by fb_urb_lock */
+	struct work_struct fb_send_work; /* sends it once a frame completes */
 	spinlock_t fb_urb_lock;
+	unsigned long fb_frame_seq; /* frames done; protected by fb_urb_lock */
+	wait_queue_head_t fb_frame_wait; /* woken when fb_frame_seq moves */
+	struct gfb_stats fb_stats;
+	struct dentry *debugfs_dir;
 
 	/* Userspace stuff */
 	int fb_count;      /* open file handle counter */
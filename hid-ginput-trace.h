@@ -0,0 +1,95 @@
+/***************************************************************************
+ *   Tracepoints of the Logitech G-series extra keys                      *
+ *                                                                         *
+ *   This program is free software: you can redistribute it and/or modify  *
+ *   it under the terms of the GNU General Public License as published by  *
+ *   the Free Software Foundation, either version 2 of the License, or     *
+ *   (at your option) any later version.                                   *
+ *                                                                         *
+ *   This driver is distributed in the hope that it will be useful, but    *
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of            *
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU      *
+ *   General Public License for more details.                              *
+ *                                                                         *
+ *   You should have received a copy of the GNU General Public License     *
+ *   along with this software. If not see <http://www.gnu.org/licenses/>.  *
+ ***************************************************************************/
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM ginput
+
+#if !defined(GINPUT_TRACE_H_INCLUDED) || defined(TRACE_HEADER_MULTI_READ)
+#define GINPUT_TRACE_H_INCLUDED		1
+
+#include <linux/hid.h>
+#include <linux/tracepoint.h>
+
+#include "hid-gcommon.h"
+
+/*
+ * The events carry the name of the hid device, which is what the
+ * gfb and ginput sysfs attributes hang off as well
+ */
+
+/* A report from the device, before any key is looked at */
+TRACE_EVENT(ginput_raw_event,
+	TP_PROTO(struct hid_device *hdev, int report_id, int size),
+	TP_ARGS(hdev, report_id, size),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(&hdev->dev))
+		__field(int, report_id)
+		__field(int, size)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(&hdev->dev));
+		__entry->report_id = report_id;
+		__entry->size = size;
+	),
+	TP_printk("%s report=%d size=%d",
+	          __get_str(dev), __entry->report_id, __entry->size)
+);
+
+/* A key of the device changed state, or was reported again */
+TRACE_EVENT(ginput_key_event,
+	TP_PROTO(struct gcommon_data *gdata, int scancode, int keycode,
+	         int value),
+	TP_ARGS(gdata, scancode, keycode, value),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(&gdata->hdev->dev))
+		__field(int, keymap)
+		__field(int, scancode)
+		__field(int, keycode)
+		__field(int, value)
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(&gdata->hdev->dev));
+		__entry->keymap = gdata->input_data.curkeymap;
+		__entry->scancode = scancode;
+		__entry->keycode = keycode;
+		__entry->value = value;
+	),
+	TP_printk("%s keymap=%d scancode=%d keycode=%d value=%d",
+	          __get_str(dev), __entry->keymap, __entry->scancode,
+	          __entry->keycode, __entry->value)
+);
+
+/* The events of a report are handed to the input layer */
+TRACE_EVENT(ginput_sync,
+	TP_PROTO(struct gcommon_data *gdata),
+	TP_ARGS(gdata),
+	TP_STRUCT__entry(
+		__string(dev, dev_name(&gdata->hdev->dev))
+	),
+	TP_fast_assign(
+		__assign_str(dev, dev_name(&gdata->hdev->dev));
+	),
+	TP_printk("%s", __get_str(dev))
+);
+
+#endif
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE hid-ginput-trace
+#include <trace/define_trace.h>
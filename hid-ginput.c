@@ -23,34 +23,58 @@
 #include <linux/module.h>
 #include <linux/input.h>
 #include <linux/hid.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
 
 #include "hid-gcommon.h"
 
+#define CREATE_TRACE_POINTS
+#include "hid-ginput-trace.h"
+
+/* The model drivers trace their reports and syncs themselves */
+EXPORT_TRACEPOINT_SYMBOL_GPL(ginput_raw_event);
+EXPORT_TRACEPOINT_SYMBOL_GPL(ginput_sync);
+
 
 #define input_get_gdata(idev) \
 	((struct gcommon_data *)(input_get_drvdata(idev)))
 #define input_get_idata(idev) \
 	((struct ginput_data *) &(input_get_gdata(idev)->input_data))
 
+/* Bounds the keymap of a device to a few pages */
+#define GINPUT_KEYMAPS_MAX 32
+
+static unsigned int keymaps = 3;
+module_param(keymaps, uint, 0444);
+MODULE_PARM_DESC(keymaps, "Number of keymaps of each device, 3 to "
+                 __stringify(GINPUT_KEYMAPS_MAX) " (default 3)");
 
 
 int ginput_alloc(struct gcommon_data * gdata, int key_count)
 {
 	struct ginput_data * input_data = &gdata->input_data;
+	struct ginput_keymap * keymap;
 	input_data->key_count = key_count;
-
-	input_data->keycode = kzalloc(key_count * sizeof(int), GFP_KERNEL);
-	if (input_data->keycode == NULL)
+	input_data->keymap_count = clamp(keymaps, 3U, (unsigned) GINPUT_KEYMAPS_MAX);
+	gdata->input_dev->keycodemax = input_data->keymap_count * key_count;
+	input_data->key_mask = key_count < 64 ? (1ULL << key_count) - 1 : ~0ULL;
+	atomic_set(&input_data->keymap_gen, 0);
+
+	keymap = kzalloc(sizeof(*keymap) +
+	                 input_data->keymap_count * key_count *
+	                 sizeof(keymap->keycode[0]), GFP_KERNEL);
+	if (keymap == NULL)
 		goto err_keycode;
+	RCU_INIT_POINTER(input_data->keymap, keymap);
 
-	input_data->scancode_state = kzalloc(3 * key_count * sizeof(int), GFP_KERNEL);
-	if (input_data->scancode_state == NULL)
-		goto err_scancode_state;
+	input_data->down_keycode = kzalloc(key_count * sizeof(unsigned int), GFP_KERNEL);
+	if (input_data->down_keycode == NULL)
+		goto err_down_keycode;
 
 	return 0;
 
-err_scancode_state:
-	kfree(input_data->keycode);
+err_down_keycode:
+	kfree(keymap);
 
 err_keycode:
 	return -ENOMEM;
@@ -59,11 +83,35 @@ EXPORT_SYMBOL_GPL(ginput_alloc);
 
 void ginput_free(struct gcommon_data * gdata)
 {
-	kfree(gdata->input_data.scancode_state);
-	kfree(gdata->input_data.keycode);
+	struct ginput_keymap * keymap;
+
+	keymap = rcu_dereference_protected(gdata->input_data.keymap, 1);
+	kfree(gdata->input_data.down_keycode);
+	kfree_rcu(keymap, rcu);
 }
 EXPORT_SYMBOL_GPL(ginput_free);
 
+void ginput_init_keymap(struct gcommon_data * gdata,
+                        const unsigned int * keycodes)
+{
+	struct ginput_data * idata = &gdata->input_data;
+	struct ginput_keymap * keymap;
+	int i;
+
+	keymap = rcu_dereference_protected(idata->keymap, 1);
+
+	for (i = 0; i < idata->key_count; i++)
+		keymap->keycode[i] = keycodes[i];
+
+	for (i = 0; i < idata->keymap_count * idata->key_count; i++) {
+		keymap->users[keymap->keycode[i]]++;
+		__set_bit(keymap->keycode[i], gdata->input_dev->keybit);
+	}
+
+	__clear_bit(KEY_RESERVED, gdata->input_dev->keybit);
+}
+EXPORT_SYMBOL_GPL(ginput_init_keymap);
+
 
 /* provide the keycode for a scancode using the current keymap */
 int ginput_get_keycode(struct input_dev * dev,
@@ -87,68 +135,162 @@ int ginput_get_keycode(struct input_dev * dev,
 	return retval;
 }
 
-void ginput_handle_key_event(struct gcommon_data *gdata,
-                             int scancode,
-                             int value)
+/*
+ * Press a key in the current keymap and remember what it was pressed as.
+ * The keymap is read directly rather than through input_get_keycode(),
+ * which would take the input core's event_lock for every key.
+ */
+static void ginput_key_down(struct gcommon_data *gdata,
+                            int scancode,
+                            const unsigned int *keycodes)
 {
 	struct input_dev * idev = gdata->input_dev;
 	struct ginput_data * idata = &gdata->input_data;
-	int error;
-	int keycode;
-	int offset;
+	unsigned int keycode;
 
-	offset = idata->key_count * idata->curkeymap;
+	keycode = READ_ONCE(keycodes[scancode]);
 
-	error = ginput_get_keycode(idev, scancode+offset, &keycode);
+	trace_ginput_key_event(gdata, scancode, keycode, 1);
 
-	if (unlikely(error)) {
-		dev_warn(&idev->dev, "%s error in ginput_get_keycode(): scancode=%d\n",
-		         gdata->name, scancode);
-		return;
-	}
+	idata->down_keycode[scancode] = keycode;
 
 	/* Only report mapped keys */
-	if (keycode != KEY_RESERVED) {
-		input_report_key(idev, keycode, value);
-	}
+	if (keycode != KEY_RESERVED)
+		input_report_key(idev, keycode, 1);
 	/* Or report MSC_SCAN on keypress of an unmapped key */
-	else if (idata->scancode_state[scancode] == 0 && value) {
+	else
 		input_event(idev, EV_MSC, MSC_SCAN, scancode);
+}
+
+/*
+ * Release a key as whatever it was pressed as, so a keymap change while
+ * it was down can't leave the old keycode pressed
+ */
+static void ginput_key_up(struct gcommon_data *gdata, int scancode)
+{
+	struct ginput_data * idata = &gdata->input_data;
+	unsigned int keycode = idata->down_keycode[scancode];
+
+	trace_ginput_key_event(gdata, scancode, keycode, 0);
+
+	if (keycode != KEY_RESERVED)
+		input_report_key(gdata->input_dev, keycode, 0);
+}
+
+/*
+ * Gather the key bits of a report into one word with bit n for scancode
+ * n, and only handle the keys whose bit differs from the previous
+ * report. Most reports change one key or none, where handling every bit
+ * of every report looked up each key in the keymap.
+ *
+ * Each report keeps its own key state, which nothing else writes, so no
+ * lock is taken here and keys are never reported under gdata->lock. A
+ * keymap switch or a new keymap only bumps keymap_gen. The next report
+ * then releases the keys it holds whose keycode differs in the new
+ * keymap and drops them from its state, so a key that is still down is
+ * pressed in the new keymap, while a keycode mapped to the same scancode
+ * in both keymaps stays pressed without a key up.
+ */
+void ginput_handle_key_report(struct gcommon_data *gdata,
+                              int report,
+                              const struct ginput_key_field *fields,
+                              int field_count,
+                              const u8 *raw_data)
+{
+	struct ginput_data *idata = &gdata->input_data;
+	struct ginput_report_state *state = &idata->report[report];
+	const unsigned int *keycodes;
+	unsigned int keymap_gen;
+	u64 keys = 0;
+	u64 changed;
+	u64 held;
+	int scancode;
+	int i;
+
+	for (i = 0; i < field_count; i++)
+		keys |= (u64)(raw_data[fields[i].offset] & fields[i].mask)
+		        << fields[i].scancode;
+
+	/* The key state and the keymaps only cover key_count scancodes */
+	keys &= idata->key_mask;
+
+	/*
+	 * Pairs with ginput_set_keymap_index() and ginput_keymap_bin_write():
+	 * a new keymap_gen means a new curkeymap or keymap
+	 */
+	keymap_gen = atomic_read(&idata->keymap_gen);
+	smp_rmb();
+
+	rcu_read_lock();
+	keycodes = rcu_dereference(idata->keymap)->keycode +
+	           idata->key_count * READ_ONCE(idata->curkeymap);
+
+	if (unlikely(state->keymap_gen != keymap_gen)) {
+		state->keymap_gen = keymap_gen;
+		held = state->keys;
+		while (held) {
+			scancode = __ffs64(held);
+			held &= held - 1;
+
+			if (READ_ONCE(keycodes[scancode]) ==
+			    idata->down_keycode[scancode])
+				continue;
+
+			ginput_key_up(gdata, scancode);
+			state->keys &= ~(1ULL << scancode);
+		}
 	}
 
-	idata->scancode_state[scancode] = value;
+	changed = keys ^ state->keys;
+	state->keys = keys;
+
+	while (changed) {
+		scancode = __ffs64(changed);
+		changed &= changed - 1;
+		if ((keys >> scancode) & 1)
+			ginput_key_down(gdata, scancode, keycodes);
+		else
+			ginput_key_up(gdata, scancode);
+	}
+
+	rcu_read_unlock();
 }
-EXPORT_SYMBOL_GPL(ginput_handle_key_event);
+EXPORT_SYMBOL_GPL(ginput_handle_key_report);
 
 
-/* set a keycode in the current keymap (kernel callback) */
+/*
+ * set a keycode in the current keymap (kernel callback)
+ *
+ * The keymap counts the scancodes mapped to each keycode, so the key
+ * bits of the input device are kept up to date without looking at the
+ * rest of the keymap.
+ */
 int ginput_setkeycode(struct input_dev * dev,
                       const struct input_keymap_entry * ke,
                       unsigned int * old_keycode)
 {
 	unsigned long irq_flags;
-	int i;
 	struct gcommon_data *gdata = input_get_gdata(dev);
 	struct ginput_data *idata = &gdata->input_data;
+	struct ginput_keymap *keymap;
 	unsigned int * scancode = (unsigned int *) ke->scancode;
 
-	if (*scancode >= dev->keycodemax)
+	if (*scancode >= dev->keycodemax || ke->keycode > KEY_MAX)
 		return -EINVAL;
 
 	spin_lock_irqsave(&gdata->lock, irq_flags);
 
-	*old_keycode = idata->keycode[*scancode];
-	idata->keycode[*scancode] = ke->keycode;
+	keymap = rcu_dereference_protected(idata->keymap,
+	                                   lockdep_is_held(&gdata->lock));
 
-	__clear_bit(*old_keycode, dev->keybit);
-	__set_bit(ke->keycode, dev->keybit);
+	*old_keycode = keymap->keycode[*scancode];
+	/* read without the lock by the key path */
+	WRITE_ONCE(keymap->keycode[*scancode], ke->keycode);
 
-	for (i = 0; i < dev->keycodemax; i++) {
-		if (idata->keycode[i] == *old_keycode) {
-			__set_bit(*old_keycode, dev->keybit);
-			break; /* Setting the bit twice is useless, so break*/
-		}
-	}
+	if (--keymap->users[*old_keycode] == 0)
+		__clear_bit(*old_keycode, dev->keybit);
+	keymap->users[ke->keycode]++;
+	__set_bit(ke->keycode, dev->keybit);
 
 	spin_unlock_irqrestore(&gdata->lock, irq_flags);
 
@@ -184,7 +326,9 @@ int ginput_getkeycode(struct input_dev *dev,
 	if (*scancode >= dev->keycodemax)
 		return -EINVAL;
 
-	ke->keycode = gdata->input_data.keycode[*scancode];
+	rcu_read_lock();
+	ke->keycode = READ_ONCE(rcu_dereference(gdata->input_data.keymap)->keycode[*scancode]);
+	rcu_read_unlock();
 
 	return 0;
 }
@@ -207,42 +351,19 @@ EXPORT_SYMBOL_GPL(ginput_keymap_index_show);
 
 ssize_t ginput_set_keymap_index(struct gcommon_data *gdata, unsigned k)
 {
-	int scancode;
-	int offset_old;
-	int offset_new;
-	int keycode_old;
-	int keycode_new;
-
-	struct input_dev *idev = gdata->input_dev;
 	struct ginput_data *idata = &gdata->input_data;
 
-	if (k > 2)
+	if (k >= idata->keymap_count)
 		return -EINVAL;
 
 	/*
-	 * Release all the pressed keys unless the new keymap has the same key
-	 * in the same scancode position.
-	 *
-	 * Also, clear the scancode state unless the new keymap has the same
-	 * key in the same scancode position.
-	 *
-	 * This allows a keycode mapped to the same scancode in two different
-	 * keymaps to remain pressed without a key up code when the keymap is
-	 * switched.
+	 * The keys held in the old keymap are sorted out by the next report
+	 * of each key, see ginput_handle_key_report(). This may run from a
+	 * report or from sysfs, so it doesn't touch the key state itself.
 	 */
-	offset_old = idata->key_count * idata->curkeymap;
-	offset_new = idata->key_count * k;
-	for (scancode = 0; scancode < idata->key_count; scancode++) {
-		keycode_old = idata->keycode[offset_old+scancode];
-		keycode_new = idata->keycode[offset_new+scancode];
-		if (keycode_old != keycode_new) {
-			if (keycode_old != KEY_RESERVED)
-				input_report_key(idev, keycode_old, 0);
-			idata->scancode_state[scancode] = 0;
-		}
-	}
-
-	idata->curkeymap = k;
+	WRITE_ONCE(idata->curkeymap, k);
+	smp_mb__before_atomic();
+	atomic_inc(&idata->keymap_gen);
 
 	if (idata->keymap_switching && idata->notify_keymap_switched) {
 		(*idata->notify_keymap_switched)(gdata, k);
@@ -292,9 +413,11 @@ ssize_t ginput_keymap_show(struct device *dev,
 
 	struct gcommon_data *gdata = dev_get_drvdata(dev);
 
-	int keymap_size = 3 * gdata->input_data.key_count;
+	int keymap_size = gdata->input_data.keymap_count * gdata->input_data.key_count;
 
-	for (scancode = 0; scancode < keymap_size; scancode++) {
+	/* Many keymaps don't fit in a page; keymap_bin has all of them */
+	for (scancode = 0; scancode < keymap_size &&
+	     offset + sizeof("0x000 0x0000\n") < PAGE_SIZE; scancode++) {
 		error = ginput_get_keycode(gdata->input_dev, scancode, &keycode);
 		if (error) {
 			dev_warn(dev, "%s error accessing scancode %d\n",
@@ -364,7 +487,7 @@ ssize_t ginput_keymap_store(struct device *dev,
 				scanned = sscanf(buf, "G%d-%d %x%n", &gkey, &index, &keycd, &consumed);
 				if (scanned == 3 &&
 				    gkey > 0 && gkey <= idata->key_count &&
-				    index >= 0 && index <= 2) {
+				    index >= 0 && index < idata->keymap_count) {
 					buf += consumed;
 					scancd = index * idata->key_count + gkey - 1;
 					error = ginput_setkeycode_internal(gdata->input_dev, scancd, keycd);
@@ -393,6 +516,127 @@ err_input_setkeycode:
 }
 EXPORT_SYMBOL_GPL(ginput_keymap_store);
 
+/*
+ * The "keymap_bin" attribute
+ */
+ssize_t ginput_keymap_bin_read(struct file *filp, struct kobject *kobj,
+                               struct bin_attribute *attr,
+                               char *buf, loff_t off, size_t count)
+{
+	struct device *dev = container_of(kobj, struct device, kobj);
+	struct gcommon_data *gdata = dev_get_drvdata(dev);
+	struct ginput_keymap *keymap;
+	size_t size = gdata->input_data.keymap_count *
+	              gdata->input_data.key_count * sizeof(u16);
+	u16 *entry = (u16 *) buf;
+	unsigned int scancode;
+
+	if (off >= size)
+		return 0;
+	count = min(count, (size_t) (size - off)) / sizeof(u16);
+
+	rcu_read_lock();
+	keymap = rcu_dereference(gdata->input_data.keymap);
+	for (scancode = (size_t) off / sizeof(u16); count; count--, scancode++)
+		*entry++ = READ_ONCE(keymap->keycode[scancode]);
+	rcu_read_unlock();
+
+	return (char *) entry - buf;
+}
+EXPORT_SYMBOL_GPL(ginput_keymap_bin_read);
+
+/*
+ * Replace the keymaps at off with the ones in buf. The keycodes are
+ * checked before taking the lock; under it, the current keymaps are
+ * copied with the new ones in place, keybit is updated for the written
+ * entries and the keymap pointer is swapped. A key event sees either
+ * the old keymaps or the new ones, never a mix, and the keys held when
+ * it is swapped are sorted out by their next report, as on a keymap
+ * switch.
+ */
+ssize_t ginput_keymap_bin_write(struct file *filp, struct kobject *kobj,
+                                struct bin_attribute *attr,
+                                char *buf, loff_t off, size_t count)
+{
+	struct device *dev = container_of(kobj, struct device, kobj);
+	struct gcommon_data *gdata = dev_get_drvdata(dev);
+	struct ginput_data *idata = &gdata->input_data;
+	struct input_dev *idev = gdata->input_dev;
+	struct ginput_keymap *keymap;
+	struct ginput_keymap *old;
+	int keymap_size = idata->keymap_count * idata->key_count;
+	size_t bank_size = idata->key_count * sizeof(u16);
+	const u16 *entry = (const u16 *) buf;
+	unsigned long irq_flags;
+	unsigned int keycode_old;
+	unsigned int first;
+	int i;
+
+	if (off >= keymap_size * sizeof(u16) ||
+	    count > keymap_size * sizeof(u16) - off)
+		return -EINVAL;
+	first = off;
+	if (count == 0 || first % bank_size || count % bank_size)
+		return -EINVAL;
+	first /= sizeof(u16);
+	count /= sizeof(u16);
+
+	for (i = 0; i < count; i++)
+		if (entry[i] > KEY_MAX)
+			return -EINVAL;
+
+	keymap = kmalloc(sizeof(*keymap) +
+	                 keymap_size * sizeof(keymap->keycode[0]), GFP_KERNEL);
+	if (keymap == NULL)
+		return -ENOMEM;
+
+	/*
+	 * The event lock keeps keys from being pressed while keybit
+	 * changes. It is taken outside gdata->lock, like the input core
+	 * does around ginput_setkeycode().
+	 */
+	spin_lock_irqsave(&idev->event_lock, irq_flags);
+	spin_lock(&gdata->lock);
+
+	old = rcu_dereference_protected(idata->keymap,
+	                                lockdep_is_held(&gdata->lock));
+
+	memcpy(keymap->users, old->users, sizeof(keymap->users));
+	memcpy(keymap->keycode, old->keycode,
+	       keymap_size * sizeof(keymap->keycode[0]));
+	for (i = 0; i < count; i++) {
+		keymap->users[old->keycode[first+i]]--;
+		keymap->keycode[first+i] = entry[i];
+		keymap->users[entry[i]]++;
+	}
+
+	/*
+	 * Drop the keys the keymaps don't have anymore and add the new
+	 * ones. A key that is still down keeps its bit, or its release
+	 * would be dropped by the input core.
+	 */
+	for (i = first; i < first + count; i++) {
+		keycode_old = old->keycode[i];
+		if (!keymap->users[keycode_old] &&
+		    !test_bit(keycode_old, idev->key))
+			__clear_bit(keycode_old, idev->keybit);
+		__set_bit(keymap->keycode[i], idev->keybit);
+	}
+	__clear_bit(KEY_RESERVED, idev->keybit);
+
+	rcu_assign_pointer(idata->keymap, keymap);
+	smp_mb__before_atomic();
+	atomic_inc(&idata->keymap_gen);
+
+	spin_unlock(&gdata->lock);
+	spin_unlock_irqrestore(&idev->event_lock, irq_flags);
+
+	kfree_rcu(old, rcu);
+
+	return count * sizeof(u16);
+}
+EXPORT_SYMBOL_GPL(ginput_keymap_bin_write);
+
 /*
  * The "keymap_switching" attribute
  */
@@ -1,14 +1,48 @@
 #ifndef GINPUT_H_INCLUDED
 #define GINPUT_H_INCLUDED		1
 
+#include <linux/atomic.h>
+#include <linux/input.h>
+#include <linux/rcupdate.h>
+
 struct gcommon_data;
 
+/* The reports a device sends its keys in, each with its own scancodes */
+#define GINPUT_REPORT_KEYS		0     /* the HID input report */
+#define GINPUT_REPORT_EP1		1     /* the G19/G110 ep1 interrupt endpoint */
+#define GINPUT_REPORT_COUNT		2
+
+/*
+ * Key state of one report. Only the completion of that report touches
+ * it, and each report has its own scancodes, so the key path takes no
+ * lock.
+ */
+struct ginput_report_state {
+	u64 keys;                     /* keys down in the last report, bit n = scancode n */
+	unsigned int keymap_gen;      /* keymap_gen the keys were pressed in */
+};
+
+/*
+ * The keycodes of all the keymaps, published through RCU so that key
+ * events look them up without a lock. Single keycodes are changed in
+ * place under gdata->lock.
+ */
+struct ginput_keymap {
+	struct rcu_head rcu;
+	u16 users[KEY_CNT];           /* scancodes mapped to each keycode */
+	unsigned int keycode[];       /* length = keymap_count * key_count */
+};
+
 struct ginput_data {
 	int key_count;                /* no of keys in the kernel keymap */
-	int * scancode_state;         /* length = key_count */
-	int * keycode;                /* length = 3 * key_count */
+	int keymap_count;             /* no of keymaps, M1 to M3 select the first three */
+	u64 key_mask;                 /* bit n set for each scancode n below key_count */
+	unsigned int * down_keycode;  /* keycode reported while a key is down, length = key_count */
+	struct ginput_keymap __rcu *keymap;
+	struct ginput_report_state report[GINPUT_REPORT_COUNT];
 
 	u8 curkeymap;                 /* current macro keymap index */
+	atomic_t keymap_gen;          /* bumped after each keymap switch or replacement */
 	u8 keymap_switching;          /* kernel keymap switch enable flag */
 
 	/* pointer to a keymap switch notification function of the parent driver, or NULL */
@@ -18,14 +52,32 @@ struct ginput_data {
 
 /* functions exposed by the module */
 
-/* alloc/free the dynamic arrays in the input_data field of gdata */
+/* alloc/free the dynamic arrays in the input_data field of gdata;
+ * alloc also sets the keycodemax of the input device
+ */
 int ginput_alloc(struct gcommon_data * gdata, int key_count);
 void ginput_free(struct gcommon_data * gdata);
 
+/* load the keycodes of the first keymap, before the input device is registered */
+void ginput_init_keymap(struct gcommon_data * gdata,
+                        const unsigned int * keycodes);
+
 
-void ginput_handle_key_event(struct gcommon_data *gdata,
-                             int scancode,
-                             int value);
+/* Report bits of a byte that are keys with consecutive scancodes */
+struct ginput_key_field {
+	u8 offset;                    /* byte of the report */
+	u8 mask;                      /* key bits of that byte */
+	u8 scancode;                  /* scancode of bit 0 */
+};
+
+/* Handle the keys of a report laid out as fields that changed since the last one;
+ * report is one of GINPUT_REPORT_*, called from that report's completion only
+ */
+void ginput_handle_key_report(struct gcommon_data *gdata,
+                              int report,
+                              const struct ginput_key_field *fields,
+                              int field_count,
+                              const u8 *raw_data);
 
 /* Kernel callbacks for input_dev
  * get/set a keycode within the current keymap
@@ -37,7 +89,7 @@ int ginput_getkeycode(struct input_dev *dev,
                       struct input_keymap_entry *ke);
 
 /* Sysfs attribute keymap_index:
- * get/set current keymap for M* buttons.
+ * get/set current keymap, 0 to keymap_count - 1; the M* buttons select 0 to 2.
  */
 ssize_t ginput_set_keymap_index(struct gcommon_data *gdata, unsigned k);
 ssize_t ginput_keymap_index_show(struct device *dev,
@@ -48,7 +100,7 @@ ssize_t ginput_keymap_index_store(struct device *dev,
                                   const char *buf, size_t count);
 
 /* Sysfs attr keymap:
- * get all current keymaps, one key per line in format: <scancode> <keycode> (both hex)
+ * get the current keymaps, as many keys as fit in a page, one key per line in format: <scancode> <keycode> (both hex)
  * set a set of keycodes; each line can be:
  *  <scancode> <keycode> (both hex, no prefix)
  *  G<key-index> <keycode> (<key-index> decimal, <keycode> hex, no prefix)
@@ -61,6 +113,19 @@ ssize_t ginput_keymap_store(struct device *dev,
                             struct device_attribute *attr,
                             const char *buf, size_t count);
 
+/* Sysfs binary attr keymap_bin:
+ * all keymaps as one u16 keycode per scancode, in host byte order
+ * read from offset 0; written a whole number of keymaps at a time, each write
+ * at most a page long, which replaces those keymaps at once or fails without
+ * changing any
+ */
+ssize_t ginput_keymap_bin_read(struct file *filp, struct kobject *kobj,
+                               struct bin_attribute *attr,
+                               char *buf, loff_t off, size_t count);
+ssize_t ginput_keymap_bin_write(struct file *filp, struct kobject *kobj,
+                                struct bin_attribute *attr,
+                                char *buf, loff_t off, size_t count);
+
 
 /* Sysfs attr keymap_switching:
  * 0 - driver does not perform keymap switching
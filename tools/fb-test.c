@@ -13,6 +13,8 @@
 
 #include <linux/fb.h>
 
+#include "../hid-gfb-ioctl.h"
+
 #define ERROR(x) printf("fbtest error in line %s:%d: %s\n", __FUNCTION__, __LINE__, strerror(errno));
 
 #define FBCTL(cmd, arg)			\
@@ -41,21 +43,23 @@ int open_fb(const char* dev)
 	return fd;
 }
 
-//static int fb_update_window(int fd, short x, short y, short w, short h)
-//{
-//	struct omapfb_update_window uw;
+static int fb_update_window(int fd, short x, short y, short w, short h)
+{
+	struct gfb_flush flush;
+	__u32 crtc = 0;
 
-//	uw.x = x;
-//	uw.y = y;
-//	uw.width = w;
-//	uw.height = h;
+	flush.count = 1;
+	flush.rects[0].x = x;
+	flush.rects[0].y = y;
+	flush.rects[0].width = w;
+	flush.rects[0].height = h;
 
-	//printf("update %d,%d,%d,%d\n", x, y, w, h);
-//	FBCTL(OMAPFB_UPDATE_WINDOW, &uw);
-//	FBCTL0(OMAPFB_SYNC_GFX);
+	printf("update %d,%d,%d,%d\n", x, y, w, h);
+	FBCTL(GFBIO_FLUSH, &flush);
+	FBCTL(FBIO_WAITFORVSYNC, &crtc);
 
-//	return 0;
-//}
+	return 0;
+}
 
 static void draw_pixel(void *fbmem, int x, int y, unsigned color)
 {
@@ -156,8 +160,7 @@ int main(int argc, char** argv)
 	int fb_num;
 	char str[64];
 	int fd;
-//	enum omapfb_update_mode update_mode;
-//	struct omapfb_display_info di;
+	__u32 update_mode = GFB_UPDATE_MANUAL;
 
 	if (argc == 2)
 		fb_num = atoi(argv[1]);
@@ -169,7 +172,8 @@ int main(int argc, char** argv)
 	
 	fd = open(str, O_RDWR);
 
-//	FBCTL(OMAPFB_GET_DISPLAY_INFO, &di);
+	/* manual updates, so the mapping below isn't write protected */
+	FBCTL(GFBIO_SET_UPDATE_MODE, &update_mode);
 
 	FBCTL(FBIOGET_VSCREENINFO, &var);
 	FBCTL(FBIOGET_FSCREENINFO, &fix);
@@ -191,9 +195,9 @@ int main(int argc, char** argv)
 
 	fill_screen(ptr);
 
-//	FBCTL(OMAPFB_GET_UPDATE_MODE, &update_mode);
-//	if (update_mode == OMAPFB_MANUAL_UPDATE)
-//		fb_update_window(fd, 0, 0, di.xres, di.yres);
+	FBCTL(GFBIO_GET_UPDATE_MODE, &update_mode);
+	if (update_mode == GFB_UPDATE_MANUAL)
+		fb_update_window(fd, 0, 0, var.xres, var.yres);
 
 	return 0;
 